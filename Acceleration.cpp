@@ -0,0 +1,809 @@
+#include "Acceleration.h"
+#include "Profiling.h"
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// bump whenever the grid build or the cache layout changes so stale files are ignored
+const uint32_t GRID_CACHE_VERSION = 3;
+
+// on-disk layout of a cached grid; every array is used in place once the file is mapped
+struct GridCacheHeader {
+   char magic[8];
+   uint32_t version;
+   uint32_t byteOrder;
+   uint64_t key;
+   uint32_t surfaceCount;
+   uint32_t primCount;
+   uint32_t unboundedCount;
+   uint32_t gridCount;
+   uint64_t primSurfaceOffset;
+   uint64_t primSubOffset;
+   uint64_t unboundedOffset;
+   uint64_t gridOffset;
+   uint64_t fileSize;
+   // hash of the whole file with this field zero, so corruption the offset and id checks
+   // cannot see still leads to a rebuild
+   uint64_t checksum;
+};
+
+// one record per grid, nested grids follow their parents breadth first
+struct GridCacheLevel {
+   float boxMin[3], boxMax[3], cellSize[3];
+   int32_t res[3];
+   int32_t firstChild;
+   int32_t childCount;
+   uint64_t startsOffset;
+   uint64_t primIdsOffset;
+   uint64_t childIdsOffset;
+   uint32_t numCells;
+   uint32_t numRefs;
+};
+
+static const char GRID_CACHE_MAGIC[8] = {'R', 'T', 'G', 'R', 'I', 'D', 0, 0};
+
+// per-thread mailbox: a primitive stamped with the current ray id was already tested
+// against that ray in another cell, so it is skipped
+static thread_local std::vector<unsigned> mailbox;
+static thread_local unsigned mailboxRay = 0;
+
+static void nextMailboxRay(size_t primCount) {
+   if (mailbox.size() < primCount) {
+      mailbox.resize(primCount, 0);
+   }
+   mailboxRay++;
+   if (mailboxRay == 0) {
+      std::fill(mailbox.begin(), mailbox.end(), 0);
+      mailboxRay = 1;
+   }
+}
+
+static float component(const Vector3& v, int axis) {
+   if (axis == 0) {
+      return v.x;
+   }
+   if (axis == 1) {
+      return v.y;
+   }
+   return v.z;
+}
+
+// FNV-1a, continued from h
+static uint64_t hashBytes(uint64_t h, const void* data, size_t size) {
+   const unsigned char* bytes = (const unsigned char*) data;
+   for (size_t i = 0; i < size; i++) {
+      h ^= bytes[i];
+      h *= 1099511628211ULL;
+   }
+   return h;
+}
+
+unsigned long long geometryHash(std::vector<Surface*>& surfaces) {
+   uint64_t h = 14695981039346656037ULL;
+   std::vector<float> data;
+   for (int k = 0; k < surfaces.size(); k++) {
+      data.clear();
+      surfaces[k]->geometry(data);
+      uint32_t count = data.size();
+      h = hashBytes(h, &count, sizeof(count));
+      h = hashBytes(h, data.data(), data.size() * sizeof(float));
+   }
+   return h;
+}
+
+/////////////////
+// Accelerator //
+/////////////////
+Accelerator::~Accelerator() {
+
+}
+
+//////////////////
+// Surface List //
+//////////////////
+void SurfaceList::build(std::vector<Surface*>& surfacesIn) {
+   surfaces = surfacesIn;
+}
+
+bool SurfaceList::hit(Ray r, float t0, float tf, HitRecord& rec) {
+   RT_STAT_ADD(primitiveTests, surfaces.size());
+   float t = tf;
+   for (int k = 0; k < surfaces.size(); k++) {
+      if (surfaces[k]->hit(r, t0, t, rec)) {
+         rec.surface = surfaces[k];
+         t = rec.t;
+      }
+   }
+   if (rec.hit) {
+      rec.surface->completeHit(r, rec);
+   }
+   return rec.hit;
+}
+
+bool SurfaceList::occluded(Ray r, float t0, float tf, HitRecord* blocker) {
+   HitRecord rec;
+   for (int k = 0; k < surfaces.size(); k++) {
+      if (surfaces[k]->castsShadow) {
+         RT_STAT(primitiveTests);
+         if (surfaces[k]->hit(r, t0, tf, rec)) {
+            rec.surface = surfaces[k];
+            if (blocker != NULL) {
+               *blocker = rec;
+            }
+            return true;
+         }
+      }
+   }
+   return false;
+}
+
+size_t SurfaceList::memoryBytes() {
+   return sizeof(*this) + surfaces.capacity() * sizeof(Surface*);
+}
+
+//////////////////
+// Uniform Grid //
+//////////////////
+UniformGrid::UniformGrid() : UniformGrid(false) {
+
+}
+
+// a coarse top level pays off only when dense cells are refined further down
+UniformGrid::UniformGrid(bool twoLevelIn) : UniformGrid(twoLevelIn ? 2 : 1, twoLevelIn ? 0.5 : 4.0, 128) {
+   twoLevel = twoLevelIn;
+   subDensity = 4.0;
+   subGridThreshold = 8;
+}
+
+UniformGrid::UniformGrid(int levelsIn, float densityIn, int maxResIn) {
+   twoLevel = false;
+   density = densityIn;
+   subDensity = densityIn;
+   subGridThreshold = 0;
+   maxRes = maxResIn;
+   buildMillis = 0.0;
+   loadedFromCache = false;
+   levels = levelsIn;
+   primList = &prims;
+   subList = &primSub;
+   res[0] = res[1] = res[2] = 0;
+   starts = NULL;
+   primIds = NULL;
+   childIds = NULL;
+   builtHash = 0;
+   mapping = NULL;
+   mappingSize = 0;
+}
+
+UniformGrid::~UniformGrid() {
+   clear();
+}
+
+void UniformGrid::clear() {
+   for (int k = 0; k < children.size(); k++) {
+      delete children[k];
+   }
+   children.clear();
+   unbounded.clear();
+   prims.clear();
+   primSub.clear();
+   cellStart.clear();
+   cellPrims.clear();
+   cellChild.clear();
+   primSurface.clear();
+   unboundedSurface.clear();
+   builtFrom.clear();
+   builtHash = 0;
+   starts = NULL;
+   primIds = NULL;
+   childIds = NULL;
+   if (mapping != NULL) {
+      munmap(mapping, mappingSize);
+      mapping = NULL;
+      mappingSize = 0;
+   }
+}
+
+int UniformGrid::resolution(int axis) {
+   return res[axis];
+}
+
+int UniformGrid::subGridCount() {
+   return children.size();
+}
+
+size_t UniformGrid::memoryBytes() {
+   // a grid loaded from the cache holds its cells in the mapping instead of the vectors
+   size_t bytes = sizeof(*this) + mappingSize + unbounded.capacity() * sizeof(Surface*) +
+      prims.capacity() * sizeof(Surface*) + primSub.capacity() * sizeof(unsigned) +
+      cellStart.capacity() * sizeof(unsigned) + cellPrims.capacity() * sizeof(unsigned) +
+      cellChild.capacity() * sizeof(int) + children.capacity() * sizeof(UniformGrid*) +
+      primSurface.capacity() * sizeof(unsigned) + unboundedSurface.capacity() * sizeof(unsigned) +
+      builtFrom.capacity() * sizeof(Surface*);
+   for (int k = 0; k < children.size(); k++) {
+      bytes += children[k]->memoryBytes();
+   }
+   return bytes;
+}
+
+void UniformGrid::build(std::vector<Surface*>& surfaces) {
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+   unsigned long long key = cacheKey(geometryHash(surfaces));
+
+   // nothing was added or moved since the last build
+   if (key == builtHash && surfaces == builtFrom) {
+      buildMillis = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+      return;
+   }
+
+   clear();
+   builtFrom = surfaces;
+   builtHash = key;
+   levels = twoLevel ? 2 : 1;
+   std::string path;
+   if (!cacheDir.empty()) {
+      char name[64];
+      snprintf(name, sizeof(name), "/grid-%016llx.bin", key);
+      path = cacheDir + name;
+      loadedFromCache = loadCache(path, key, surfaces);
+      if (loadedFromCache) {
+         buildMillis = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+         return;
+      }
+   }
+   loadedFromCache = false;
+
+   std::vector<unsigned> ids;
+   std::vector<BoundingBox> primBounds;
+   BoundingBox all;
+   for (int k = 0; k < surfaces.size(); k++) {
+      int count = surfaces[k]->primitiveCount();
+      if (count == 1 && !surfaces[k]->bounds().bounded()) {
+         unbounded.push_back(surfaces[k]);
+         unboundedSurface.push_back(k);
+         continue;
+      }
+      for (int p = 0; p < count; p++) {
+         BoundingBox b = surfaces[k]->primitiveBounds(p);
+         ids.push_back(prims.size());
+         prims.push_back(surfaces[k]);
+         primSub.push_back(p);
+         primSurface.push_back(k);
+         primBounds.push_back(b);
+         all.expand(b);
+      }
+   }
+   buildLevel(primBounds, ids, all, density);
+
+   if (!path.empty()) {
+      saveCache(path, key);
+   }
+   buildMillis = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void UniformGrid::buildLevel(std::vector<BoundingBox>& boundsIn, std::vector<unsigned>& ids,
+   BoundingBox boxIn, float cellDensity) {
+   if (ids.empty()) {
+      box = BoundingBox();
+      res[0] = res[1] = res[2] = 1;
+      cellSize = Vector3(1.0, 1.0, 1.0);
+      cellStart.assign(2, 0);
+      cellChild.assign(1, -1);
+      starts = cellStart.data();
+      primIds = cellPrims.data();
+      childIds = cellChild.data();
+      return;
+   }
+
+   // give flat scenes some thickness so every axis has a usable cell size
+   box = boxIn;
+   Vector3 ext = box.extent();
+   float pad = std::max(1e-4f, 1e-4f * std::max(ext.x, std::max(ext.y, ext.z)));
+   box.expand(box.min - Vector3(pad, pad, pad));
+   box.expand(box.max + Vector3(pad, pad, pad));
+   ext = box.extent();
+
+   // pick the resolution so the grid holds roughly cellDensity cells per primitive
+   float volume = ext.x * ext.y * ext.z;
+   float cellsPerUnit = std::cbrt(cellDensity * ids.size() / volume);
+   for (int a = 0; a < 3; a++) {
+      int n = (int) std::round(component(ext, a) * cellsPerUnit);
+      res[a] = std::max(1, std::min(maxRes, n));
+   }
+   cellSize = Vector3(ext.x / res[0], ext.y / res[1], ext.z / res[2]);
+
+   // count, prefix sum, then scatter primitive ids into their overlapping cells
+   int numCells = res[0] * res[1] * res[2];
+   cellStart.assign(numCells + 1, 0);
+   int lo[3], hi[3];
+   for (int k = 0; k < ids.size(); k++) {
+      cellRange(boundsIn[ids[k]], lo, hi);
+      for (int z = lo[2]; z <= hi[2]; z++) {
+         for (int y = lo[1]; y <= hi[1]; y++) {
+            for (int x = lo[0]; x <= hi[0]; x++) {
+               cellStart[x + res[0] * (y + res[1] * z) + 1]++;
+            }
+         }
+      }
+   }
+   for (int c = 0; c < numCells; c++) {
+      cellStart[c + 1] += cellStart[c];
+   }
+   cellPrims.resize(cellStart[numCells]);
+   std::vector<unsigned> fill(cellStart.begin(), cellStart.end() - 1);
+   for (int k = 0; k < ids.size(); k++) {
+      cellRange(boundsIn[ids[k]], lo, hi);
+      for (int z = lo[2]; z <= hi[2]; z++) {
+         for (int y = lo[1]; y <= hi[1]; y++) {
+            for (int x = lo[0]; x <= hi[0]; x++) {
+               cellPrims[fill[x + res[0] * (y + res[1] * z)]++] = ids[k];
+            }
+         }
+      }
+   }
+
+   // refine cells that are still too dense with a grid of their own
+   cellChild.assign(numCells, -1);
+   starts = cellStart.data();
+   primIds = cellPrims.data();
+   childIds = cellChild.data();
+   if (levels < 2) {
+      return;
+   }
+   for (int z = 0; z < res[2]; z++) {
+      for (int y = 0; y < res[1]; y++) {
+         for (int x = 0; x < res[0]; x++) {
+            int c = x + res[0] * (y + res[1] * z);
+            int count = cellStart[c + 1] - cellStart[c];
+            if (count <= subGridThreshold) {
+               continue;
+            }
+            Vector3 cellMin = box.min + Vector3(x * cellSize.x, y * cellSize.y, z * cellSize.z);
+            BoundingBox cellBox(cellMin, cellMin + cellSize);
+            std::vector<unsigned> cellIds(cellPrims.begin() + cellStart[c], cellPrims.begin() + cellStart[c + 1]);
+            UniformGrid* child = new UniformGrid(levels - 1, subDensity, maxRes);
+            child->primList = primList;
+            child->subList = subList;
+            child->buildLevel(boundsIn, cellIds, cellBox, subDensity);
+            cellChild[c] = children.size();
+            children.push_back(child);
+         }
+      }
+   }
+}
+
+void UniformGrid::cellRange(BoundingBox b, int lo[3], int hi[3]) {
+   for (int a = 0; a < 3; a++) {
+      float origin = component(box.min, a);
+      float size = component(cellSize, a);
+      lo[a] = (int) std::floor((component(b.min, a) - origin) / size);
+      hi[a] = (int) std::floor((component(b.max, a) - origin) / size);
+      lo[a] = std::max(0, std::min(res[a] - 1, lo[a]));
+      hi[a] = std::max(0, std::min(res[a] - 1, hi[a]));
+   }
+}
+
+unsigned long long UniformGrid::cacheKey(unsigned long long geomHash) {
+   uint64_t h = hashBytes(geomHash, &GRID_CACHE_VERSION, sizeof(GRID_CACHE_VERSION));
+   int32_t params[4] = {twoLevel, subGridThreshold, maxRes, (int32_t) sizeof(GridCacheLevel)};
+   float densities[2] = {density, subDensity};
+   h = hashBytes(h, params, sizeof(params));
+   return hashBytes(h, densities, sizeof(densities));
+}
+
+// like hashBytes, but eight bytes per step so checking a large cache file stays cheap
+static uint64_t hashWords(uint64_t h, const void* data, size_t size) {
+   const unsigned char* bytes = (const unsigned char*) data;
+   size_t words = size / 8;
+   for (size_t i = 0; i < words; i++) {
+      uint64_t w;
+      memcpy(&w, bytes + i * 8, 8);
+      h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+      h ^= h >> 32;
+   }
+   return hashBytes(h, bytes + words * 8, size - words * 8);
+}
+
+static uint64_t cacheChecksum(GridCacheHeader header, const char* rest, size_t restSize) {
+   header.checksum = 0;
+   return hashWords(hashWords(14695981039346656037ULL, &header, sizeof(header)), rest, restSize);
+}
+
+// true when count elements of the given size and alignment lie at offset inside the file
+static bool cacheSpan(uint64_t fileSize, uint64_t offset, uint64_t count, uint64_t size, uint64_t align) {
+   return offset % align == 0 && offset <= fileSize && count <= (fileSize - offset) / size;
+}
+
+// checks every offset, count and id of a mapped cache file whose header already matched, so
+// a truncated or corrupt file is rebuilt instead of read out of bounds
+static bool validCache(const char* base, const GridCacheHeader* header, std::vector<Surface*>& surfaces) {
+   uint64_t size = header->fileSize;
+   if (!cacheSpan(size, header->gridOffset, header->gridCount, sizeof(GridCacheLevel), alignof(GridCacheLevel)) ||
+      !cacheSpan(size, header->primSurfaceOffset, header->primCount, sizeof(uint32_t), alignof(uint32_t)) ||
+      !cacheSpan(size, header->primSubOffset, header->primCount, sizeof(uint32_t), alignof(uint32_t)) ||
+      !cacheSpan(size, header->unboundedOffset, header->unboundedCount, sizeof(uint32_t), alignof(uint32_t))) {
+      return false;
+   }
+   const uint32_t* primSurfaceIds = (const uint32_t*) (base + header->primSurfaceOffset);
+   const uint32_t* primSubIds = (const uint32_t*) (base + header->primSubOffset);
+   const uint32_t* unboundedIds = (const uint32_t*) (base + header->unboundedOffset);
+   for (uint32_t k = 0; k < header->primCount; k++) {
+      if (primSurfaceIds[k] >= surfaces.size() || primSubIds[k] >= (uint32_t) surfaces[primSurfaceIds[k]]->primitiveCount()) {
+         return false;
+      }
+   }
+   for (uint32_t k = 0; k < header->unboundedCount; k++) {
+      if (unboundedIds[k] >= surfaces.size()) {
+         return false;
+      }
+   }
+
+   // every grid but the first must be the child of exactly one earlier grid, handed out in
+   // order, so each record has its grid by the time it is read
+   const GridCacheLevel* records = (const GridCacheLevel*) (base + header->gridOffset);
+   uint64_t assigned = 1;
+   for (uint32_t g = 0; g < header->gridCount; g++) {
+      const GridCacheLevel& rec = records[g];
+      if (g >= assigned || rec.childCount < 0 || (rec.childCount > 0 && (uint64_t) rec.firstChild != assigned)) {
+         return false;
+      }
+      assigned += rec.childCount;
+      if (assigned > header->gridCount) {
+         return false;
+      }
+      uint64_t cells = 1;
+      for (int a = 0; a < 3; a++) {
+         if (rec.res[a] < 1 || !(rec.cellSize[a] > 0.0f) || !std::isfinite(rec.boxMin[a]) || !std::isfinite(rec.boxMax[a])) {
+            return false;
+         }
+         cells *= rec.res[a];
+      }
+      if (cells != rec.numCells ||
+         !cacheSpan(size, rec.startsOffset, (uint64_t) rec.numCells + 1, sizeof(uint32_t), alignof(uint32_t)) ||
+         !cacheSpan(size, rec.primIdsOffset, rec.numRefs, sizeof(uint32_t), alignof(uint32_t)) ||
+         !cacheSpan(size, rec.childIdsOffset, rec.numCells, sizeof(int32_t), alignof(int32_t))) {
+         return false;
+      }
+      const uint32_t* starts = (const uint32_t*) (base + rec.startsOffset);
+      const uint32_t* primIds = (const uint32_t*) (base + rec.primIdsOffset);
+      const int32_t* childIds = (const int32_t*) (base + rec.childIdsOffset);
+      if (starts[0] != 0 || starts[rec.numCells] != rec.numRefs) {
+         return false;
+      }
+      for (uint32_t c = 0; c < rec.numCells; c++) {
+         if (starts[c] > starts[c + 1] || childIds[c] < -1 || childIds[c] >= rec.childCount) {
+            return false;
+         }
+      }
+      for (uint32_t k = 0; k < rec.numRefs; k++) {
+         if (primIds[k] >= header->primCount) {
+            return false;
+         }
+      }
+   }
+   return assigned == header->gridCount;
+}
+
+bool UniformGrid::loadCache(std::string path, unsigned long long key, std::vector<Surface*>& surfaces) {
+   int fd = open(path.c_str(), O_RDONLY);
+   if (fd < 0) {
+      return false;
+   }
+   struct stat st;
+   if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(GridCacheHeader)) {
+      close(fd);
+      return false;
+   }
+   void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (data == MAP_FAILED) {
+      return false;
+   }
+
+   const char* base = (const char*) data;
+   const GridCacheHeader* header = (const GridCacheHeader*) base;
+   if (memcmp(header->magic, GRID_CACHE_MAGIC, sizeof(GRID_CACHE_MAGIC)) != 0 || header->version != GRID_CACHE_VERSION
+      || header->byteOrder != 0x01020304 || header->key != key || header->surfaceCount != surfaces.size()
+      || header->fileSize != (uint64_t) st.st_size || header->gridCount == 0 || !validCache(base, header, surfaces)
+      || cacheChecksum(*header, base + sizeof(GridCacheHeader), st.st_size - sizeof(GridCacheHeader)) != header->checksum) {
+      munmap(data, st.st_size);
+      return false;
+   }
+   mapping = data;
+   mappingSize = st.st_size;
+
+   const uint32_t* primSurfaceIds = (const uint32_t*) (base + header->primSurfaceOffset);
+   const uint32_t* primSubIds = (const uint32_t*) (base + header->primSubOffset);
+   const uint32_t* unboundedIds = (const uint32_t*) (base + header->unboundedOffset);
+   prims.reserve(header->primCount);
+   for (uint32_t k = 0; k < header->primCount; k++) {
+      prims.push_back(surfaces[primSurfaceIds[k]]);
+   }
+   primSub.assign(primSubIds, primSubIds + header->primCount);
+   for (uint32_t k = 0; k < header->unboundedCount; k++) {
+      unbounded.push_back(surfaces[unboundedIds[k]]);
+   }
+
+   // grids are stored breadth first, so every child record follows its parent
+   const GridCacheLevel* records = (const GridCacheLevel*) (base + header->gridOffset);
+   std::vector<UniformGrid*> grids(header->gridCount, NULL);
+   grids[0] = this;
+   for (uint32_t g = 0; g < header->gridCount; g++) {
+      const GridCacheLevel& rec = records[g];
+      UniformGrid* grid = grids[g];
+      grid->box = BoundingBox(Vector3(rec.boxMin[0], rec.boxMin[1], rec.boxMin[2]),
+         Vector3(rec.boxMax[0], rec.boxMax[1], rec.boxMax[2]));
+      grid->cellSize = Vector3(rec.cellSize[0], rec.cellSize[1], rec.cellSize[2]);
+      for (int a = 0; a < 3; a++) {
+         grid->res[a] = rec.res[a];
+      }
+      grid->starts = (const unsigned*) (base + rec.startsOffset);
+      grid->primIds = (const unsigned*) (base + rec.primIdsOffset);
+      grid->childIds = (const int*) (base + rec.childIdsOffset);
+      for (int c = 0; c < rec.childCount; c++) {
+         UniformGrid* child = new UniformGrid(1, subDensity, maxRes);
+         child->primList = primList;
+         child->subList = subList;
+         grid->children.push_back(child);
+         grids[rec.firstChild + c] = child;
+      }
+   }
+   return true;
+}
+
+void UniformGrid::saveCache(std::string path, unsigned long long key) {
+   std::vector<UniformGrid*> grids(1, this);
+   std::vector<GridCacheLevel> records;
+   for (int g = 0; g < grids.size(); g++) {
+      UniformGrid* grid = grids[g];
+      GridCacheLevel rec;
+      memset(&rec, 0, sizeof(rec));
+      float boxMin[3] = {grid->box.min.x, grid->box.min.y, grid->box.min.z};
+      float boxMax[3] = {grid->box.max.x, grid->box.max.y, grid->box.max.z};
+      float size[3] = {grid->cellSize.x, grid->cellSize.y, grid->cellSize.z};
+      memcpy(rec.boxMin, boxMin, sizeof(boxMin));
+      memcpy(rec.boxMax, boxMax, sizeof(boxMax));
+      memcpy(rec.cellSize, size, sizeof(size));
+      for (int a = 0; a < 3; a++) {
+         rec.res[a] = grid->res[a];
+      }
+      rec.numCells = grid->res[0] * grid->res[1] * grid->res[2];
+      rec.numRefs = grid->starts[rec.numCells];
+      rec.firstChild = grids.size();
+      rec.childCount = grid->children.size();
+      grids.insert(grids.end(), grid->children.begin(), grid->children.end());
+      records.push_back(rec);
+   }
+
+   GridCacheHeader header;
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, GRID_CACHE_MAGIC, sizeof(GRID_CACHE_MAGIC));
+   header.version = GRID_CACHE_VERSION;
+   header.byteOrder = 0x01020304;
+   header.key = key;
+   header.surfaceCount = builtFrom.size();
+   header.primCount = primSurface.size();
+   header.unboundedCount = unboundedSurface.size();
+   header.gridCount = records.size();
+   header.gridOffset = sizeof(GridCacheHeader);
+   header.primSurfaceOffset = header.gridOffset + records.size() * sizeof(GridCacheLevel);
+   header.primSubOffset = header.primSurfaceOffset + primSurface.size() * sizeof(uint32_t);
+   header.unboundedOffset = header.primSubOffset + primSub.size() * sizeof(uint32_t);
+   uint64_t offset = header.unboundedOffset + unboundedSurface.size() * sizeof(uint32_t);
+   for (int g = 0; g < records.size(); g++) {
+      records[g].startsOffset = offset;
+      offset += (records[g].numCells + 1) * sizeof(uint32_t);
+      records[g].primIdsOffset = offset;
+      offset += records[g].numRefs * sizeof(uint32_t);
+      records[g].childIdsOffset = offset;
+      offset += records[g].numCells * sizeof(int32_t);
+   }
+   header.fileSize = offset;
+
+   // write next to the destination and rename so concurrent jobs never map a partial file
+   mkdir(cacheDir.c_str(), 0755);
+   std::string tmpPath = path + "." + std::to_string(getpid()) + ".tmp";
+   FILE* f = fopen(tmpPath.c_str(), "wb");
+   if (f == NULL) {
+      return;
+   }
+   // assembled in memory first, since the checksum in the header covers all of it
+   std::vector<char> body;
+   body.reserve(offset - sizeof(header));
+   auto append = [&](const void* data, size_t bytes) {
+      body.insert(body.end(), (const char*) data, (const char*) data + bytes);
+   };
+   append(records.data(), records.size() * sizeof(GridCacheLevel));
+   append(primSurface.data(), primSurface.size() * sizeof(uint32_t));
+   append(primSub.data(), primSub.size() * sizeof(uint32_t));
+   append(unboundedSurface.data(), unboundedSurface.size() * sizeof(uint32_t));
+   for (int g = 0; g < records.size(); g++) {
+      UniformGrid* grid = grids[g];
+      append(grid->starts, (records[g].numCells + 1) * sizeof(uint32_t));
+      append(grid->primIds, records[g].numRefs * sizeof(uint32_t));
+      append(grid->childIds, records[g].numCells * sizeof(int32_t));
+   }
+   header.checksum = cacheChecksum(header, body.data(), body.size());
+   bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+   ok = ok && fwrite(body.data(), 1, body.size(), f) == body.size();
+   ok = fclose(f) == 0 && ok;
+   if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) {
+      remove(tmpPath.c_str());
+   }
+}
+
+bool UniformGrid::hit(Ray r, float t0, float tf, HitRecord& rec) {
+   nextMailboxRay(prims.size());
+   float t = tf;
+   if (traverse(r, t0, t, false, rec)) {
+      t = rec.t;
+   }
+   RT_STAT_ADD(primitiveTests, unbounded.size());
+   for (int k = 0; k < unbounded.size(); k++) {
+      if (unbounded[k]->hit(r, t0, t, rec)) {
+         rec.surface = unbounded[k];
+         t = rec.t;
+      }
+   }
+   if (rec.hit) {
+      rec.surface->completeHit(r, rec);
+   }
+   return rec.hit;
+}
+bool UniformGrid::occluded(Ray r, float t0, float tf, HitRecord* blocker) {
+   HitRecord rec;
+   for (int k = 0; k < unbounded.size(); k++) {
+      if (unbounded[k]->castsShadow) {
+         RT_STAT(primitiveTests);
+         if (unbounded[k]->hit(r, t0, tf, rec)) {
+            rec.surface = unbounded[k];
+            if (blocker != NULL) {
+               *blocker = rec;
+            }
+            return true;
+         }
+      }
+   }
+   nextMailboxRay(prims.size());
+   if (!traverse(r, t0, tf, true, rec)) {
+      return false;
+   }
+   if (blocker != NULL) {
+      *blocker = rec;
+   }
+   return true;
+}
+
+// 3D-DDA (Amanatides and Woo) through the cells pierced by the ray
+bool UniformGrid::traverse(Ray& r, float t0, float tf, bool anyHit, HitRecord& rec) {
+   float tEnter, tExit;
+   if (!box.hit(r, t0, tf, tEnter, tExit)) {
+      return false;
+   }
+
+   Vector3 p = r.val(tEnter);
+   int cell[3], step[3], out[3];
+   float tMax[3], tDelta[3];
+   for (int a = 0; a < 3; a++) {
+      float o = component(r.origin, a), d = component(r.dir, a);
+      float lo = component(box.min, a), size = component(cellSize, a);
+      cell[a] = (int) std::floor((component(p, a) - lo) / size);
+      cell[a] = std::max(0, std::min(res[a] - 1, cell[a]));
+      if (d > 0.0) {
+         step[a] = 1;
+         out[a] = res[a];
+         tMax[a] = (lo + (cell[a] + 1) * size - o) / d;
+         tDelta[a] = size / d;
+      }
+      else if (d < 0.0) {
+         step[a] = -1;
+         out[a] = -1;
+         tMax[a] = (lo + cell[a] * size - o) / d;
+         tDelta[a] = -size / d;
+      }
+      else {
+         step[a] = 0;
+         out[a] = -1;
+         tMax[a] = INFINITY;
+         tDelta[a] = INFINITY;
+      }
+   }
+
+   bool found = false;
+   float tClosest = tf;
+   while (true) {
+      int c = cell[0] + res[0] * (cell[1] + res[1] * cell[2]);
+      RT_STAT(nodeVisits);
+      float cellExit = std::min(tMax[0], std::min(tMax[1], tMax[2]));
+      if (childIds[c] >= 0) {
+         if (children[childIds[c]]->traverse(r, t0, tClosest, anyHit, rec)) {
+            if (anyHit) {
+               return true;
+            }
+            found = true;
+            tClosest = rec.t;
+         }
+      }
+      else {
+         // consecutive primitives of one surface are handed over together so a SphereSet
+         // can test them with its batch kernel
+         unsigned batch[64];
+         int count = 0;
+         Surface* batchSurface = NULL;
+         for (unsigned i = starts[c]; i < starts[c + 1]; i++) {
+            unsigned id = primIds[i];
+            if (mailbox[id] == mailboxRay) {
+               continue;
+            }
+            mailbox[id] = mailboxRay;
+            Surface* s = (*primList)[id];
+            if (count > 0 && (s != batchSurface || count == 64)) {
+               if (testBatch(batchSurface, batch, count, r, t0, tClosest, anyHit, rec)) {
+                  if (anyHit) {
+                     return true;
+                  }
+                  found = true;
+               }
+               count = 0;
+            }
+            batchSurface = s;
+            batch[count++] = (*subList)[id];
+         }
+         if (count > 0 && testBatch(batchSurface, batch, count, r, t0, tClosest, anyHit, rec)) {
+            if (anyHit) {
+               return true;
+            }
+            found = true;
+         }
+      }
+
+      // a hit inside the current cell cannot be beaten by anything further along the ray
+      if (found && tClosest <= cellExit) {
+         break;
+      }
+      if (cellExit > tExit) {
+         break;
+      }
+      int a = (tMax[0] < tMax[1]) ? (tMax[0] < tMax[2] ? 0 : 2) : (tMax[1] < tMax[2] ? 1 : 2);
+      cell[a] += step[a];
+      if (cell[a] == out[a]) {
+         break;
+      }
+      tMax[a] += tDelta[a];
+   }
+   return found;
+}
+
+bool UniformGrid::testBatch(Surface* s, unsigned* batch, int count, Ray& r, float t0, float& tClosest, bool anyHit,
+   HitRecord& rec) {
+   HitRecord tmp;
+   if (anyHit) {
+      if (!s->castsShadow) {
+         return false;
+      }
+      RT_STAT_ADD(primitiveTests, count);
+      if (!s->hitPrimitives(batch, count, r, t0, tClosest, tmp)) {
+         return false;
+      }
+      rec.surface = s;
+      rec.index = tmp.index;
+      return true;
+   }
+   RT_STAT_ADD(primitiveTests, count);
+   if (!s->hitPrimitives(batch, count, r, t0, tClosest, tmp)) {
+      return false;
+   }
+   rec = tmp;
+   rec.surface = s;
+   tClosest = tmp.t;
+   return true;
+}
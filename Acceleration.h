@@ -0,0 +1,111 @@
+#ifndef ACCELERATION_H
+#define ACCELERATION_H
+
+#include "RayTracer.h"
+#include <vector>
+#include <string>
+
+// content hash over the geometry of every surface, in order
+unsigned long long geometryHash(std::vector<Surface*>& surfaces);
+
+// common interface for every scene index so they can be swapped and benchmarked
+class Accelerator {
+   public:
+      virtual ~Accelerator();
+
+      virtual void build(std::vector<Surface*>& surfaces) = 0;
+      // closest hit, returned with its shading fields completed
+      virtual bool hit(Ray r, float t0, float tf, HitRecord& rec) = 0;
+      // whether a shadow casting surface is hit between t0 and tf; blocker, when given,
+      // receives the surface and primitive index of the hit found
+      virtual bool occluded(Ray r, float t0, float tf, HitRecord* blocker = NULL) = 0;
+      // bytes held by the index itself, not counting the surfaces it refers to
+      virtual size_t memoryBytes() = 0;
+};
+
+// tests every surface in order, identical to the original brute force loop
+class SurfaceList : public Accelerator {
+   public:
+      std::vector<Surface*> surfaces;
+
+      void build(std::vector<Surface*>& surfacesIn);
+      bool hit(Ray r, float t0, float tf, HitRecord& rec);
+      bool occluded(Ray r, float t0, float tf, HitRecord* blocker = NULL);
+      size_t memoryBytes();
+};
+
+class UniformGrid : public Accelerator {
+   public:
+      // target cells per primitive for the top level and for the grids nested in dense cells
+      float density;
+      float subDensity;
+      // cells holding more than this many primitives get their own grid (two-level mode only)
+      int subGridThreshold;
+      bool twoLevel;
+      int maxRes;
+      // directory of serialised grids keyed by geometry hash, empty to always build in memory
+      std::string cacheDir;
+
+      // how the last call to build() obtained the grid
+      double buildMillis;
+      bool loadedFromCache;
+
+      UniformGrid();
+      UniformGrid(bool twoLevelIn);
+      ~UniformGrid();
+
+      void build(std::vector<Surface*>& surfaces);
+      bool hit(Ray r, float t0, float tf, HitRecord& rec);
+      bool occluded(Ray r, float t0, float tf, HitRecord* blocker = NULL);
+      size_t memoryBytes();
+
+      int resolution(int axis);
+      int subGridCount();
+
+   private:
+      // primitives without finite bounds (e.g. planes) are tested on every ray
+      std::vector<Surface*> unbounded;
+      // primitive k is primitive primSub[k] of surface prims[k]
+      std::vector<Surface*> prims;
+      std::vector<unsigned> primSub;
+      // nested grids index into the primitives of the top level grid
+      std::vector<Surface*>* primList;
+      std::vector<unsigned>* subList;
+      int levels;
+      BoundingBox box;
+      int res[3];
+      Vector3 cellSize;
+
+      // cell k holds primIds[starts[k] .. starts[k+1]); the arrays point either into the
+      // vectors below or straight into a memory mapped cache file
+      const unsigned* starts;
+      const unsigned* primIds;
+      const int* childIds;
+      std::vector<unsigned> cellStart;
+      std::vector<unsigned> cellPrims;
+      std::vector<int> cellChild;
+      std::vector<UniformGrid*> children;
+
+      // surface indices of prims and unbounded, written to the cache in place of pointers
+      std::vector<unsigned> primSurface;
+      std::vector<unsigned> unboundedSurface;
+      std::vector<Surface*> builtFrom;
+      unsigned long long builtHash;
+      void* mapping;
+      size_t mappingSize;
+
+      UniformGrid(int levelsIn, float densityIn, int maxResIn);
+      void clear();
+      void buildLevel(std::vector<BoundingBox>& boundsIn, std::vector<unsigned>& ids,
+         BoundingBox boxIn, float cellDensity);
+      void cellRange(BoundingBox b, int lo[3], int hi[3]);
+      bool traverse(Ray& r, float t0, float tf, bool anyHit, HitRecord& rec);
+      bool testBatch(Surface* s, unsigned* batch, int count, Ray& r, float t0, float& tClosest, bool anyHit,
+         HitRecord& rec);
+
+      unsigned long long cacheKey(unsigned long long geomHash);
+      bool loadCache(std::string path, unsigned long long key, std::vector<Surface*>& surfaces);
+      void saveCache(std::string path, unsigned long long key);
+};
+
+#endif
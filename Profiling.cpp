@@ -0,0 +1,532 @@
+#include "Profiling.h"
+#include <cstdio>
+#include <cstdlib>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+#ifdef __linux__
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#include <sys/resource.h>
+#ifdef __APPLE__
+#include <sys/sysctl.h>
+#endif
+
+//////////////////
+// Thread Slots //
+//////////////////
+
+// every thread that ever counted or traced owns a slot; slots outlive their threads so data
+// from finished workers is still collected, and are reused by later threads. Only the owning
+// thread writes to a slot, so recording never takes a lock.
+class ThreadSlot {
+   public:
+      int id;
+      bool inUse;
+      RenderStats stats;
+      std::vector<TraceEvent> events;
+
+      // counters are opened by, and only count, the thread currently owning the slot
+      PerfCounters perf;
+      int perfFds[PerfCounters::EVENTS];
+      bool perfOpen;
+      int perfPhase;
+      unsigned long long perfLast[PerfCounters::EVENTS];
+};
+
+static void closeCounters(ThreadSlot* slot);
+
+static std::mutex slotMutex;
+static std::vector<ThreadSlot*> threadSlots;
+
+class ThreadSlotHolder {
+   public:
+      ThreadSlot* slot;
+
+      ThreadSlotHolder() {
+         std::lock_guard<std::mutex> lock(slotMutex);
+         slot = NULL;
+         for (int k = 0; k < threadSlots.size() && slot == NULL; k++) {
+            if (!threadSlots[k]->inUse) {
+               slot = threadSlots[k];
+            }
+         }
+         if (slot == NULL) {
+            slot = new ThreadSlot();
+            slot->id = threadSlots.size();
+            slot->perfOpen = false;
+            threadSlots.push_back(slot);
+         }
+         slot->inUse = true;
+         slot->perfPhase = -1;
+      }
+
+      ~ThreadSlotHolder() {
+         closeCounters(slot);
+         std::lock_guard<std::mutex> lock(slotMutex);
+         slot->inUse = false;
+      }
+};
+
+static ThreadSlot* localSlot() {
+   static thread_local ThreadSlotHolder holder;
+   return holder.slot;
+}
+
+//////////////////
+// Render Stats //
+//////////////////
+
+RenderStats::RenderStats() {
+   reset();
+}
+
+void RenderStats::reset() {
+   primaryRays = 0;
+   shadowRays = 0;
+   shadowLookups = 0;
+   reflectionRays = 0;
+   lightsReached = 0;
+   primitiveTests = 0;
+   nodeVisits = 0;
+   for (int d = 0; d < MAX_DEPTH; d++) {
+      depthHistogram[d] = 0;
+   }
+}
+
+void RenderStats::merge(const RenderStats& other) {
+   primaryRays += other.primaryRays;
+   shadowRays += other.shadowRays;
+   shadowLookups += other.shadowLookups;
+   reflectionRays += other.reflectionRays;
+   lightsReached += other.lightsReached;
+   primitiveTests += other.primitiveTests;
+   nodeVisits += other.nodeVisits;
+   for (int d = 0; d < MAX_DEPTH; d++) {
+      depthHistogram[d] += other.depthHistogram[d];
+   }
+}
+
+void RenderStats::print(FILE* f, int frame) {
+   int deepest = MAX_DEPTH - 1;
+   while (deepest > 0 && depthHistogram[deepest] == 0) {
+      deepest--;
+   }
+   fprintf(f, "{\"frame\": %d, \"primary_rays\": %llu, \"shadow_rays\": %llu, \"shadow_lookups\": %llu, \"reflection_rays\": %llu, "
+      "\"lights_reached\": %llu, \"primitive_tests\": %llu, \"node_visits\": %llu, \"depth_histogram\": [", frame, primaryRays,
+      shadowRays, shadowLookups, reflectionRays, lightsReached, primitiveTests, nodeVisits);
+   for (int d = 0; d <= deepest; d++) {
+      fprintf(f, "%s%llu", d > 0 ? ", " : "", depthHistogram[d]);
+   }
+   fprintf(f, "]}\n");
+}
+
+RenderStats& RenderStats::local() {
+   return localSlot()->stats;
+}
+
+RenderStats RenderStats::collect() {
+   std::lock_guard<std::mutex> lock(slotMutex);
+   RenderStats total;
+   for (int k = 0; k < threadSlots.size(); k++) {
+      total.merge(threadSlots[k]->stats);
+      threadSlots[k]->stats.reset();
+   }
+   return total;
+}
+
+///////////
+// Trace //
+///////////
+
+bool Trace::enabled = false;
+static long long traceStart = 0;
+static std::string tracePath;
+
+static void writeTraceAtExit() {
+   if (!Trace::write(tracePath.c_str())) {
+      fprintf(stderr, "could not write trace to %s\n", tracePath.c_str());
+   }
+}
+
+void Trace::enable(const char* path) {
+   if (!enabled) {
+      traceStart = now();
+      std::atexit(writeTraceAtExit);
+   }
+   tracePath = path;
+   enabled = true;
+}
+
+long long Trace::now() {
+   return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Trace::record(const char* name, long long startNanos, int arg) {
+   TraceEvent e;
+   e.name = name;
+   e.startNanos = startNanos;
+   e.durationNanos = now() - startNanos;
+   e.arg = arg;
+   localSlot()->events.push_back(e);
+}
+
+bool Trace::write(const char* path) {
+   FILE* f = fopen(path, "w");
+   if (f == NULL) {
+      return false;
+   }
+   // complete ("X") events with microsecond timestamps, one track per thread slot
+   std::lock_guard<std::mutex> lock(slotMutex);
+   fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+   bool first = true;
+   for (int k = 0; k < threadSlots.size(); k++) {
+      ThreadSlot* slot = threadSlots[k];
+      fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"thread %d\"}}",
+         first ? "" : ",\n", slot->id, slot->id);
+      first = false;
+      for (int e = 0; e < slot->events.size(); e++) {
+         TraceEvent& ev = slot->events[e];
+         fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f",
+            ev.name, slot->id, (ev.startNanos - traceStart) / 1000.0, ev.durationNanos / 1000.0);
+         if (ev.arg >= 0) {
+            fprintf(f, ", \"args\": {\"index\": %d}", ev.arg);
+         }
+         fprintf(f, "}");
+      }
+   }
+   fprintf(f, "\n]}\n");
+   return fclose(f) == 0;
+}
+
+////////////////
+// TraceScope //
+////////////////
+
+TraceScope::TraceScope(const char* nameIn, int argIn) {
+   name = nameIn;
+   arg = argIn;
+   start = Trace::enabled ? Trace::now() : 0;
+}
+
+TraceScope::~TraceScope() {
+   if (Trace::enabled) {
+      Trace::record(name, start, arg);
+   }
+}
+
+///////////////////
+// Perf Counters //
+///////////////////
+
+static const char* perfPhaseNames[PERF_PHASES] = {"build", "primary", "shadow", "reflection", "encode"};
+static const char* perfEventNames[PerfCounters::EVENTS] = {"cycles", "instructions", "cache_misses", "branch_misses"};
+// 0 until the first thread tried to open counters, then 1 if that worked and -1 if not
+static std::atomic<int> perfState(0);
+
+PerfCounters::PerfCounters() {
+   reset();
+}
+
+void PerfCounters::reset() {
+   for (int p = 0; p < PERF_PHASES; p++) {
+      for (int e = 0; e < EVENTS; e++) {
+         values[p][e] = 0;
+      }
+   }
+   for (int e = 0; e < EVENTS; e++) {
+      counted[e] = false;
+   }
+   multiplexed = false;
+}
+
+void PerfCounters::merge(const PerfCounters& other) {
+   for (int p = 0; p < PERF_PHASES; p++) {
+      for (int e = 0; e < EVENTS; e++) {
+         values[p][e] += other.values[p][e];
+      }
+   }
+   for (int e = 0; e < EVENTS; e++) {
+      counted[e] = counted[e] || other.counted[e];
+   }
+   multiplexed = multiplexed || other.multiplexed;
+}
+
+void PerfCounters::print(FILE* f, int frame) {
+   if (perfState != 1) {
+      return;
+   }
+   fprintf(f, "{\"frame\": %d, \"multiplexed\": %s, \"counters\": {", frame, multiplexed ? "true" : "false");
+   for (int p = 0; p < PERF_PHASES; p++) {
+      fprintf(f, "%s\"%s\": {", p > 0 ? ", " : "", perfPhaseNames[p]);
+      for (int e = 0; e < EVENTS; e++) {
+         if (counted[e]) {
+            fprintf(f, "\"%s\": %llu, ", perfEventNames[e], values[p][e]);
+         }
+         else {
+            fprintf(f, "\"%s\": null, ", perfEventNames[e]);
+         }
+      }
+      if (counted[0] && counted[1] && values[p][0] > 0) {
+         fprintf(f, "\"ipc\": %.3f}", values[p][1] / (double) values[p][0]);
+      }
+      else {
+         fprintf(f, "\"ipc\": null}");
+      }
+   }
+   fprintf(f, "}}\n");
+}
+
+#ifdef __linux__
+static int openEvent(unsigned long long config, int groupFd) {
+   perf_event_attr attr;
+   memset(&attr, 0, sizeof(attr));
+   attr.size = sizeof(attr);
+   attr.type = PERF_TYPE_HARDWARE;
+   attr.config = config;
+   attr.disabled = groupFd == -1 ? 1 : 0;
+   attr.exclude_kernel = 1;
+   attr.exclude_hv = 1;
+   attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+   return syscall(__NR_perf_event_open, &attr, 0, -1, groupFd, 0);
+}
+#endif
+
+// opens one counter group for the calling thread; events the CPU lacks are left out
+static bool openCounters(ThreadSlot* slot) {
+   for (int e = 0; e < PerfCounters::EVENTS; e++) {
+      slot->perfFds[e] = -1;
+      slot->perfLast[e] = 0;
+   }
+#ifdef __linux__
+   unsigned long long configs[PerfCounters::EVENTS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+      PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+   int leader = -1;
+   const char* reason = NULL;
+   for (int e = 0; e < PerfCounters::EVENTS; e++) {
+      slot->perfFds[e] = openEvent(configs[e], leader);
+      if (slot->perfFds[e] == -1 && reason == NULL) {
+         reason = strerror(errno);
+      }
+      if (leader == -1) {
+         leader = slot->perfFds[e];
+      }
+   }
+   if (leader != -1) {
+      ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+   }
+#else
+   int leader = -1;
+   const char* reason = "perf_event_open is Linux only";
+#endif
+   std::lock_guard<std::mutex> lock(slotMutex);
+   if (perfState == 0) {
+      perfState = leader != -1 ? 1 : -1;
+      if (leader == -1) {
+         fprintf(stderr, "hardware counters unavailable (%s), render phases will not be measured\n", reason);
+      }
+   }
+   slot->perfOpen = leader != -1;
+   return slot->perfOpen;
+}
+
+static void closeCounters(ThreadSlot* slot) {
+   if (!slot->perfOpen) {
+      return;
+   }
+   for (int e = PerfCounters::EVENTS - 1; e >= 0; e--) {
+      if (slot->perfFds[e] != -1) {
+#ifdef __linux__
+         close(slot->perfFds[e]);
+#endif
+         slot->perfFds[e] = -1;
+      }
+   }
+   slot->perfOpen = false;
+}
+
+// adds what the group counted since the last read to the phase the thread is leaving
+static void readCounters(ThreadSlot* slot) {
+#ifdef __linux__
+   int leader = -1;
+   for (int e = 0; e < PerfCounters::EVENTS && leader == -1; e++) {
+      leader = slot->perfFds[e];
+   }
+   // nr, time enabled, time running, then one value per opened event in opening order
+   unsigned long long data[3 + PerfCounters::EVENTS];
+   if (read(leader, data, sizeof(data)) <= 0) {
+      return;
+   }
+   int next = 3;
+   for (int e = 0; e < PerfCounters::EVENTS; e++) {
+      if (slot->perfFds[e] == -1) {
+         continue;
+      }
+      unsigned long long value = data[next++];
+      if (slot->perfPhase >= 0) {
+         slot->perf.values[slot->perfPhase][e] += value - slot->perfLast[e];
+         slot->perf.counted[e] = true;
+      }
+      slot->perfLast[e] = value;
+   }
+   if (data[2] < data[1]) {
+      slot->perf.multiplexed = true;
+   }
+#endif
+}
+
+bool PerfCounters::available() {
+   if (perfState == -1) {
+      return false;
+   }
+   ThreadSlot* slot = localSlot();
+   return slot->perfOpen || openCounters(slot);
+}
+
+int PerfCounters::enter(int phase) {
+   if (!available()) {
+      return -1;
+   }
+   ThreadSlot* slot = localSlot();
+   readCounters(slot);
+   int previous = slot->perfPhase;
+   slot->perfPhase = phase;
+   return previous;
+}
+
+PerfCounters PerfCounters::collect() {
+   std::lock_guard<std::mutex> lock(slotMutex);
+   PerfCounters total;
+   for (int k = 0; k < threadSlots.size(); k++) {
+      total.merge(threadSlots[k]->perf);
+      threadSlots[k]->perf.reset();
+   }
+   return total;
+}
+
+///////////////
+// PerfPhase //
+///////////////
+
+PerfPhase::PerfPhase(int phase) {
+   previous = PerfCounters::enter(phase);
+}
+
+PerfPhase::~PerfPhase() {
+   PerfCounters::enter(previous);
+}
+
+///////////////////
+// Memory Report //
+///////////////////
+
+static const char* memoryCategoryNames[MEM_CATEGORIES] = {"primitives", "materials", "acceleration", "framebuffers", "output"};
+
+MemoryReport::MemoryReport() {
+   for (int c = 0; c < MEM_CATEGORIES; c++) {
+      bytes[c] = 0;
+   }
+   primitives = 0;
+   peakResident = 0;
+   peakFrame = -1;
+}
+
+size_t MemoryReport::total() {
+   size_t sum = 0;
+   for (int c = 0; c < MEM_CATEGORIES; c++) {
+      sum += bytes[c];
+   }
+   return sum;
+}
+
+void MemoryReport::print(FILE* f) {
+   fprintf(f, "memory:\n");
+   for (int c = 0; c < MEM_CATEGORIES; c++) {
+      fprintf(f, "  %-14s %10.1f KiB", memoryCategoryNames[c], bytes[c] / 1024.0);
+      if (c == MEM_PRIMITIVES && primitives > 0) {
+         fprintf(f, "  (%d primitives, %.1f bytes each)", primitives, bytes[c] / (double) primitives);
+      }
+      fprintf(f, "\n");
+   }
+   fprintf(f, "  %-14s %10.1f KiB\n", "total", total() / 1024.0);
+   if (peakFrame >= 0) {
+      fprintf(f, "  peak resident  %10.1f KiB in frame %d\n", peakResident / 1024.0, peakFrame);
+   }
+}
+
+size_t peakResidentBytes() {
+#ifdef __linux__
+   FILE* f = fopen("/proc/self/status", "r");
+   if (f != NULL) {
+      char line[256];
+      long kib = -1;
+      while (fgets(line, sizeof(line), f) != NULL) {
+         if (strncmp(line, "VmHWM:", 6) == 0) {
+            sscanf(line + 6, "%ld", &kib);
+         }
+      }
+      fclose(f);
+      if (kib >= 0) {
+         return kib * 1024;
+      }
+   }
+#endif
+   rusage usage;
+   getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+   return usage.ru_maxrss;
+#else
+   return usage.ru_maxrss * 1024;
+#endif
+}
+
+void resetPeakResident() {
+#ifdef __linux__
+   // "5" resets VmHWM to the current resident size (Linux 4.0 and later)
+   FILE* f = fopen("/proc/self/clear_refs", "w");
+   if (f != NULL) {
+      fputs("5", f);
+      fclose(f);
+   }
+#endif
+}
+
+/////////////
+// Machine //
+/////////////
+std::string cpuModel() {
+#ifdef __linux__
+   FILE* f = fopen("/proc/cpuinfo", "r");
+   if (f != NULL) {
+      char line[256];
+      std::string model;
+      while (model.empty() && fgets(line, sizeof(line), f) != NULL) {
+         const char* colon = strchr(line, ':');
+         if (strncmp(line, "model name", 10) == 0 && colon != NULL) {
+            model = colon + 1;
+         }
+      }
+      fclose(f);
+      // trim the leading space and trailing newline
+      size_t first = model.find_first_not_of(" \t");
+      size_t last = model.find_last_not_of(" \t\n");
+      if (first != std::string::npos) {
+         return model.substr(first, last - first + 1);
+      }
+   }
+#elif defined(__APPLE__)
+   char brand[256];
+   size_t size = sizeof(brand);
+   if (sysctlbyname("machdep.cpu.brand_string", brand, &size, NULL, 0) == 0) {
+      return brand;
+   }
+#endif
+   return "unknown";
+}
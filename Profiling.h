@@ -0,0 +1,155 @@
+#ifndef PROFILING_H
+#define PROFILING_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Render statistics are only gathered when compiled with -DRT_STATS; otherwise the
+// RT_STAT macros expand to nothing and the render loop carries no extra work.
+#ifdef RT_STATS
+#define RT_STAT(field) (RenderStats::local().field++)
+#define RT_STAT_ADD(field, n) (RenderStats::local().field += (n))
+#define RT_STAT_DEPTH(depth) (RenderStats::local().depthHistogram[(depth) < RenderStats::MAX_DEPTH ? (depth) : RenderStats::MAX_DEPTH - 1]++)
+#else
+#define RT_STAT(field) ((void) 0)
+#define RT_STAT_ADD(field, n) ((void) 0)
+#define RT_STAT_DEPTH(depth) ((void) 0)
+#endif
+
+// Hardware counters per render phase need -DRT_PERF and Linux perf_event_open; every phase
+// change reads the counters, so this build is for profiling only. Without the flag
+// RT_PERF_PHASE expands to nothing.
+#ifdef RT_PERF
+#define RT_PERF_PHASE(phase) PerfPhase perfPhaseScope(phase)
+#else
+#define RT_PERF_PHASE(phase) ((void) 0)
+#endif
+
+class RenderStats {
+   public:
+      static const int MAX_DEPTH = 16;
+
+      unsigned long long primaryRays;
+      unsigned long long shadowRays;
+      // shadow queries the shadow map or the shadow cache answered without a ray
+      unsigned long long shadowLookups;
+      unsigned long long reflectionRays;
+      // lights the light tree returned for the hits shaded, Scene::lightSource not included
+      unsigned long long lightsReached;
+      unsigned long long primitiveTests;
+      unsigned long long nodeVisits;
+      // rays traced at each recursion depth of Scene::rayColor, the last bucket collects deeper rays
+      unsigned long long depthHistogram[MAX_DEPTH];
+
+      RenderStats();
+      void reset();
+      void merge(const RenderStats& other);
+      void print(FILE* f, int frame);
+
+      // counters of the calling thread, only ever touched by that thread
+      static RenderStats& local();
+      // sums the counters of every thread and clears them; call once no thread is rendering
+      static RenderStats collect();
+};
+
+// Timeline tracing: when enabled, begin/end pairs are appended to a buffer owned by the
+// calling thread and written as Chrome about:tracing / Perfetto JSON when the program exits.
+class TraceEvent {
+   public:
+      // must point to a string that lives until exit, normally a literal
+      const char* name;
+      long long startNanos;
+      long long durationNanos;
+      // shown as an argument in the viewer when not negative, e.g. the tile or frame index
+      int arg;
+};
+
+class Trace {
+   public:
+      static bool enabled;
+
+      // turns tracing on and writes everything recorded to path at exit
+      static void enable(const char* path);
+      static long long now();
+      static void record(const char* name, long long startNanos, int arg);
+      static bool write(const char* path);
+};
+
+// records one event covering its own lifetime
+class TraceScope {
+   public:
+      TraceScope(const char* nameIn, int argIn = -1);
+      ~TraceScope();
+
+   private:
+      const char* name;
+      int arg;
+      long long start;
+};
+
+// work is attributed to the innermost phase, so a shadow ray traced while shading a
+// reflection counts towards PERF_SHADOW only
+enum PerfPhaseId { PERF_BUILD, PERF_PRIMARY, PERF_SHADOW, PERF_REFLECTION, PERF_ENCODE, PERF_PHASES };
+
+class PerfCounters {
+   public:
+      // cycles, instructions, cache misses, branch misses
+      static const int EVENTS = 4;
+
+      unsigned long long values[PERF_PHASES][EVENTS];
+      // events the hardware or the kernel refused are reported as null
+      bool counted[EVENTS];
+      // set when the kernel had to time-share the counters, which makes the values estimates
+      bool multiplexed;
+
+      PerfCounters();
+      void reset();
+      void merge(const PerfCounters& other);
+      void print(FILE* f, int frame);
+
+      // opens counters for the calling thread on first use; false (after one notice on
+      // stderr) when perf_event_open is missing or not permitted
+      static bool available();
+      // moves the calling thread into phase and returns the phase it was in
+      static int enter(int phase);
+      // sums every thread's counts and clears them; call once no thread is rendering
+      static PerfCounters collect();
+};
+
+class PerfPhase {
+   public:
+      PerfPhase(int phase);
+      ~PerfPhase();
+
+   private:
+      int previous;
+};
+
+enum MemoryCategory { MEM_PRIMITIVES, MEM_MATERIALS, MEM_ACCELERATION, MEM_FRAMEBUFFERS, MEM_OUTPUT, MEM_CATEGORIES };
+
+// bytes held by one scene, by category; programs add what they own themselves (e.g. the
+// buffers their output goes through) before printing
+class MemoryReport {
+   public:
+      size_t bytes[MEM_CATEGORIES];
+      int primitives;
+      // highest resident set size seen at the end of any frame, and which frame that was
+      size_t peakResident;
+      int peakFrame;
+
+      MemoryReport();
+      size_t total();
+      void print(FILE* f);
+};
+
+// high-water mark of the process resident set size; resetting it is only possible on
+// Linux, elsewhere the peak covers the whole run
+size_t peakResidentBytes();
+void resetPeakResident();
+
+// processor name as reported by the OS, e.g. for keying per-machine caches; "unknown" if
+// it cannot be read
+std::string cpuModel();
+
+#endif
@@ -1,11 +1,47 @@
 #include <math.h>
 #include "RayTracer.h"
+#include "Acceleration.h"
 #include <iostream>
 #include <cmath>
 #include <vector>
 #include <algorithm>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <climits>
+#include <cstdlib>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
-bool printDetails = true;
+std::chrono::steady_clock::time_point programStart = std::chrono::steady_clock::now();
+
+// cycle counter where the CPU has one, nanoseconds elsewhere
+static unsigned long long costClock() {
+#if defined(__x86_64__) || defined(__i386__)
+   return __rdtsc();
+#else
+   return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+// maps 0..1 onto a dark blue - cyan - yellow - dark red ramp
+static Color falseColor(float x) {
+   const int stops = 6;
+   const float ramp[stops][3] = {{48, 18, 59}, {70, 134, 251}, {26, 228, 182}, {164, 252, 60}, {250, 186, 57}, {122, 4, 3}};
+   x = std::max(0.0f, std::min(1.0f, x)) * (stops - 1);
+   int k = std::min((int) x, stops - 2);
+   float f = x - k;
+   return Color(ramp[k][0] + (ramp[k + 1][0] - ramp[k][0]) * f, ramp[k][1] + (ramp[k + 1][1] - ramp[k][1]) * f,
+      ramp[k][2] + (ramp[k + 1][2] - ramp[k][2]) * f);
+}
 
 /////////////
 // Vector3 //
@@ -89,6 +125,74 @@ Vector3 Ray::val(float t) {
    return Vector3(x, y, z);
 }
 
+//////////////////
+// Bounding Box //
+//////////////////
+BoundingBox::BoundingBox() {
+   min = Vector3(INFINITY, INFINITY, INFINITY);
+   max = Vector3(-INFINITY, -INFINITY, -INFINITY);
+}
+
+BoundingBox::BoundingBox(Vector3 minIn, Vector3 maxIn) {
+   min = minIn;
+   max = maxIn;
+}
+
+void BoundingBox::expand(Vector3 p) {
+   min = Vector3(std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z));
+   max = Vector3(std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z));
+}
+
+void BoundingBox::expand(BoundingBox box) {
+   expand(box.min);
+   expand(box.max);
+}
+
+bool BoundingBox::empty() {
+   return min.x > max.x || min.y > max.y || min.z > max.z;
+}
+
+bool BoundingBox::bounded() {
+   return std::isfinite(min.x) && std::isfinite(min.y) && std::isfinite(min.z)
+      && std::isfinite(max.x) && std::isfinite(max.y) && std::isfinite(max.z);
+}
+
+bool BoundingBox::contains(Vector3 p) {
+   return p.x >= min.x && p.y >= min.y && p.z >= min.z && p.x <= max.x && p.y <= max.y && p.z <= max.z;
+}
+
+Vector3 BoundingBox::extent() {
+   return max - min;
+}
+
+bool BoundingBox::hit(Ray r, float t0, float tf, float& tEnter, float& tExit) {
+   // slab test, clipped to [t0, tf]
+   float o[3] = {r.origin.x, r.origin.y, r.origin.z};
+   float d[3] = {r.dir.x, r.dir.y, r.dir.z};
+   float lo[3] = {min.x, min.y, min.z};
+   float hi[3] = {max.x, max.y, max.z};
+   tEnter = t0;
+   tExit = tf;
+   for (int a = 0; a < 3; a++) {
+      float invD = 1.0f / d[a];
+      float tNear = (lo[a] - o[a]) * invD;
+      float tFar = (hi[a] - o[a]) * invD;
+      if (invD < 0.0) {
+         std::swap(tNear, tFar);
+      }
+      tEnter = tNear > tEnter ? tNear : tEnter;
+      tExit = tFar < tExit ? tFar : tExit;
+      if (tEnter > tExit) {
+         return false;
+      }
+   }
+   return true;
+}
+
+BoundingBox BoundingBox::infinite() {
+   return BoundingBox(Vector3(-INFINITY, -INFINITY, -INFINITY), Vector3(INFINITY, INFINITY, INFINITY));
+}
+
 ////////////
 // Camera //
 ////////////
@@ -98,6 +202,27 @@ Vector3 Camera::pixelToPos(int xi, int yi) {
    return u * ucoord + v * vcoord;
 }
 
+Vector3 Camera::imageToPos(float x, float y) {
+   float ucoord = l + (r - l) * x / nx;
+   float vcoord = b + (t - b) * y / ny;
+   return u * ucoord + v * vcoord;
+}
+
+void Camera::parameters(std::vector<float>& data) {
+   Vector3 basis[4] = {w, e, u, v};
+   for (int k = 0; k < 4; k++) {
+      data.push_back(basis[k].x);
+      data.push_back(basis[k].y);
+      data.push_back(basis[k].z);
+   }
+   data.push_back(t);
+   data.push_back(b);
+   data.push_back(l);
+   data.push_back(r);
+   data.push_back(nx);
+   data.push_back(ny);
+}
+
 /////////////////////////
 // Orthographic Camera //
 /////////////////////////
@@ -127,6 +252,21 @@ Ray OrthographicCamera::viewRay(int xi, int yi) {
    return Ray(origin, dir);
 }
 
+Ray OrthographicCamera::subpixelRay(float x, float y) {
+   return Ray(e + imageToPos(x, y), w * -1.0);
+}
+
+bool OrthographicCamera::project(Vector3 pos, float& xi, float& yi, float& depth) {
+   Vector3 d = pos - e;
+   depth = -Vector3::dot(d, w);
+   if (depth < 0.0) {
+      return false;
+   }
+   xi = (Vector3::dot(d, u) - l) * nx / (r - l) - 0.5;
+   yi = (Vector3::dot(d, v) - b) * ny / (t - b) - 0.5;
+   return true;
+}
+
 void OrthographicCamera::changeOrientation(Vector3 viewPoint, Vector3 up, Vector3 viewDir) {
    w = (viewDir * -1.0f).normalized();
    e = viewPoint;
@@ -164,6 +304,10 @@ Ray PerspectiveCamera::viewRay(int xi, int yi) {
    return Ray(origin, dir);
 }
 
+Ray PerspectiveCamera::subpixelRay(float x, float y) {
+   return Ray(e, (w * -distToCam + imageToPos(x, y)).normalized());
+}
+
 void PerspectiveCamera::changeOrientation(Vector3 viewPoint, Vector3 up, Vector3 viewDir) {
    w = (viewDir * -1.0f).normalized();
    e = viewPoint;
@@ -171,6 +315,24 @@ void PerspectiveCamera::changeOrientation(Vector3 viewPoint, Vector3 up, Vector3
    v = Vector3::cross(w, u);
 }
 
+bool PerspectiveCamera::project(Vector3 pos, float& xi, float& yi, float& depth) {
+   // scale the offset back onto the image plane at distToCam in front of the eye
+   Vector3 d = pos - e;
+   float z = -Vector3::dot(d, w);
+   if (z <= 0.0) {
+      return false;
+   }
+   xi = (Vector3::dot(d, u) * distToCam / z - l) * nx / (r - l) - 0.5;
+   yi = (Vector3::dot(d, v) * distToCam / z - b) * ny / (t - b) - 0.5;
+   depth = d.magnitude();
+   return true;
+}
+
+void PerspectiveCamera::parameters(std::vector<float>& data) {
+   Camera::parameters(data);
+   data.push_back(distToCam);
+}
+
 ///////////
 // Color //
 ///////////
@@ -226,6 +388,7 @@ Material::Material() {
    ambientIntensity = 1.0;
    phongExp = 1.0;
    glazed = false;
+   emission = 0.0;
 }
 
 Material::Material(Color surfaceColorIn, Color specularColorIn, Color ambientColorIn, 
@@ -238,26 +401,50 @@ Material::Material(Color surfaceColorIn, Color specularColorIn, Color ambientCol
    ambientIntensity = ambientIntensityIn;
    phongExp = phongExpIn;
    glazed = false;
+   emission = 0.0;
 }
 
 /////////////
 // Surface //
 /////////////
 Surface::Surface() {
-   material = Material();
+   materialId = 0;
+   castsShadow = true;
+}
+
+Surface::Surface(int materialIdIn) {
+   materialId = materialIdIn;
+   castsShadow = true;
+}
+
+Surface::~Surface() {
+
+}
+
+int Surface::primitiveCount() {
+   return 1;
+}
+
+BoundingBox Surface::primitiveBounds(int /* prim */) {
+   return bounds();
+}
+
+bool Surface::hitPrimitives(const unsigned* /* prims */, int /* count */, Ray r, float t0, float tf, HitRecord& rec) {
+   return hit(r, t0, tf, rec);
 }
 
-Surface::Surface(Material materialIn) {
-   material = materialIn;
+void Surface::completeHit(Ray& r, HitRecord& rec) {
+   rec.pos = r.val(rec.t);
+   rec.normal = normal(rec.pos);
+   rec.materialId = materialId;
 }
 
 ////////////
 // Sphere //
 ////////////
-Sphere::Sphere(float radiusIn, Vector3 centerIn, Material materialIn) {
+Sphere::Sphere(float radiusIn, Vector3 centerIn, int materialIdIn) : Surface(materialIdIn) {
    radius = radiusIn;
    center = centerIn;
-   material = materialIn;
 }
 
 bool Sphere::hit(Ray r, float t0, float tf, HitRecord& rec) {
@@ -284,15 +471,37 @@ Vector3 Sphere::normal(Vector3 pos) {
    return normal.normalized();
 }
 
+void Sphere::completeHit(Ray& r, HitRecord& rec) {
+   rec.pos = r.val(rec.t);
+   rec.normal = (rec.pos - center).normalized();
+   rec.materialId = materialId;
+}
+
+BoundingBox Sphere::bounds() {
+   Vector3 r(radius, radius, radius);
+   return BoundingBox(center - r, center + r);
+}
+
+void Sphere::geometry(std::vector<float>& data) {
+   data.push_back(center.x);
+   data.push_back(center.y);
+   data.push_back(center.z);
+   data.push_back(radius);
+   data.push_back(materialId);
+}
+
+size_t Sphere::memoryBytes() {
+   return sizeof(*this);
+}
+
 //////////////
 // Triangle //
 //////////////
-Triangle::Triangle(Vector3 aIn, Vector3 bIn, Vector3 cIn, Material materialIn) {
+Triangle::Triangle(Vector3 aIn, Vector3 bIn, Vector3 cIn, int materialIdIn) : Surface(materialIdIn) {
    a = aIn;
    b = bIn;
    c = cIn;
    n = Vector3::cross(b - a, c - b).normalized();
-   material = materialIn;
 }
 
 bool Triangle::hit(Ray r, float t0, float tf, HitRecord& rec) {
@@ -308,17 +517,24 @@ bool Triangle::hit(Ray r, float t0, float tf, HitRecord& rec) {
       return false;
    }
 
-   // see if intersection point is within the triangle
-   if (Vector3::dot(Vector3::cross((b - a), (x - a)), n) < 0.0) {
+   // see if intersection point is within the triangle; each test is twice the area of
+   // the sub-triangle opposite one vertex, which also gives the barycentric coordinates
+   float wc = Vector3::dot(Vector3::cross((b - a), (x - a)), n);
+   if (wc < 0.0) {
       return false;
    }
-   if (Vector3::dot(Vector3::cross((c - b), (x - b)), n) < 0.0) {
+   float wa = Vector3::dot(Vector3::cross((c - b), (x - b)), n);
+   if (wa < 0.0) {
       return false;
    }
-   if (Vector3::dot(Vector3::cross((a - c), (x - c)), n) < 0.0) {
+   float wb = Vector3::dot(Vector3::cross((a - c), (x - c)), n);
+   if (wb < 0.0) {
       return false;
    }
    rec = HitRecord(t);
+   float area = wa + wb + wc;
+   rec.u = wb / area;
+   rec.v = wc / area;
    return true;
 }
 
@@ -326,11 +542,37 @@ Vector3 Triangle::normal(Vector3 pos) {
    return n;
 }
 
+void Triangle::completeHit(Ray& r, HitRecord& rec) {
+   rec.pos = r.val(rec.t);
+   rec.normal = n;
+   rec.materialId = materialId;
+}
+
+BoundingBox Triangle::bounds() {
+   BoundingBox box(a, a);
+   box.expand(b);
+   box.expand(c);
+   return box;
+}
+
+void Triangle::geometry(std::vector<float>& data) {
+   Vector3 verts[3] = {a, b, c};
+   for (int k = 0; k < 3; k++) {
+      data.push_back(verts[k].x);
+      data.push_back(verts[k].y);
+      data.push_back(verts[k].z);
+   }
+   data.push_back(materialId);
+}
+
+size_t Triangle::memoryBytes() {
+   return sizeof(*this);
+}
+
 ///////////
 // Plane //
 ///////////
-Plane::Plane(Vector3 aIn, Vector3 b, Vector3 c, Material materialIn) {
-   material = materialIn;
+Plane::Plane(Vector3 aIn, Vector3 b, Vector3 c, int materialIdIn) : Surface(materialIdIn) {
    a = aIn;
    n = Vector3::cross(b - a, c - b).normalized();
 }
@@ -355,17 +597,254 @@ Vector3 Plane::normal(Vector3 pos) {
    return n;
 }
 
+void Plane::completeHit(Ray& r, HitRecord& rec) {
+   rec.pos = r.val(rec.t);
+   rec.normal = n;
+   rec.materialId = materialId;
+}
+
+BoundingBox Plane::bounds() {
+   return BoundingBox::infinite();
+}
+
+void Plane::geometry(std::vector<float>& data) {
+   data.push_back(a.x);
+   data.push_back(a.y);
+   data.push_back(a.z);
+   data.push_back(n.x);
+   data.push_back(n.y);
+   data.push_back(n.z);
+   data.push_back(materialId);
+}
+
+size_t Plane::memoryBytes() {
+   return sizeof(*this);
+}
+
+////////////////
+// Sphere Set //
+////////////////
+int SphereSet::simdWidth = SphereSet::MAX_SIMD_WIDTH;
+
+SphereSet::SphereSet() {
+
+}
+
+void SphereSet::add(Vector3 center, float radiusIn, int materialId) {
+   allIds.push_back(centerX.size());
+   centerX.push_back(center.x);
+   centerY.push_back(center.y);
+   centerZ.push_back(center.z);
+   radius.push_back(radiusIn);
+   materialIds.push_back(materialId);
+}
+
+int SphereSet::size() {
+   return centerX.size();
+}
+
+bool SphereSet::hit(Ray r, float t0, float tf, HitRecord& rec) {
+   return hitPrimitives(allIds.data(), allIds.size(), r, t0, tf, rec);
+}
+
+Vector3 SphereSet::normal(Vector3 pos) {
+   // without a hit record the sphere has to be found again: the one whose surface is closest
+   int closest = 0;
+   float closestDist = INFINITY;
+   for (int k = 0; k < size(); k++) {
+      Vector3 c(centerX[k], centerY[k], centerZ[k]);
+      float dist = std::abs((pos - c).magnitude() - radius[k]);
+      if (dist < closestDist) {
+         closestDist = dist;
+         closest = k;
+      }
+   }
+   Vector3 c(centerX[closest], centerY[closest], centerZ[closest]);
+   return (pos - c) / radius[closest];
+}
+
+BoundingBox SphereSet::bounds() {
+   BoundingBox box;
+   for (int k = 0; k < size(); k++) {
+      box.expand(primitiveBounds(k));
+   }
+   return box;
+}
+
+void SphereSet::geometry(std::vector<float>& data) {
+   data.insert(data.end(), centerX.begin(), centerX.end());
+   data.insert(data.end(), centerY.begin(), centerY.end());
+   data.insert(data.end(), centerZ.begin(), centerZ.end());
+   data.insert(data.end(), radius.begin(), radius.end());
+   data.insert(data.end(), materialIds.begin(), materialIds.end());
+}
+
+size_t SphereSet::memoryBytes() {
+   return sizeof(*this) + (centerX.capacity() + centerY.capacity() + centerZ.capacity() + radius.capacity()) * sizeof(float) +
+      materialIds.capacity() * sizeof(unsigned short) + allIds.capacity() * sizeof(unsigned);
+}
+
+int SphereSet::primitiveCount() {
+   return size();
+}
+
+BoundingBox SphereSet::primitiveBounds(int prim) {
+   Vector3 c(centerX[prim], centerY[prim], centerZ[prim]);
+   Vector3 r(radius[prim], radius[prim], radius[prim]);
+   return BoundingBox(c - r, c + r);
+}
+
+bool SphereSet::hitPrimitives(const unsigned* prims, int count, Ray r, float t0, float tf, HitRecord& rec) {
+   // same near-root test as Sphere::hit, simplified for a unit length direction; the
+   // discriminant is taken from the ray's closest approach to the center, which unlike
+   // b^2 - c does not cancel away for small spheres far from the origin
+   float best = tf;
+   int bestIdx = -1;
+   int k = 0;
+   int width = simdWidth;
+#ifdef __AVX__
+   if (width >= 8) {
+      __m256 ox = _mm256_set1_ps(r.origin.x), oy = _mm256_set1_ps(r.origin.y), oz = _mm256_set1_ps(r.origin.z);
+      __m256 dx = _mm256_set1_ps(r.dir.x), dy = _mm256_set1_ps(r.dir.y), dz = _mm256_set1_ps(r.dir.z);
+      __m256 lower = _mm256_set1_ps(t0), zero = _mm256_setzero_ps();
+      for (; k < count; k += 8) {
+         // pad a short final batch by repeating its last sphere
+         int idx[8];
+         for (int l = 0; l < 8; l++) {
+            idx[l] = prims[std::min(k + l, count - 1)];
+         }
+   #ifdef __AVX2__
+         __m256i vidx = _mm256_loadu_si256((const __m256i*) idx);
+         __m256 cx = _mm256_i32gather_ps(centerX.data(), vidx, 4);
+         __m256 cy = _mm256_i32gather_ps(centerY.data(), vidx, 4);
+         __m256 cz = _mm256_i32gather_ps(centerZ.data(), vidx, 4);
+         __m256 rad = _mm256_i32gather_ps(radius.data(), vidx, 4);
+   #else
+         __m256 cx = _mm256_set_ps(centerX[idx[7]], centerX[idx[6]], centerX[idx[5]], centerX[idx[4]],
+            centerX[idx[3]], centerX[idx[2]], centerX[idx[1]], centerX[idx[0]]);
+         __m256 cy = _mm256_set_ps(centerY[idx[7]], centerY[idx[6]], centerY[idx[5]], centerY[idx[4]],
+            centerY[idx[3]], centerY[idx[2]], centerY[idx[1]], centerY[idx[0]]);
+         __m256 cz = _mm256_set_ps(centerZ[idx[7]], centerZ[idx[6]], centerZ[idx[5]], centerZ[idx[4]],
+            centerZ[idx[3]], centerZ[idx[2]], centerZ[idx[1]], centerZ[idx[0]]);
+         __m256 rad = _mm256_set_ps(radius[idx[7]], radius[idx[6]], radius[idx[5]], radius[idx[4]],
+            radius[idx[3]], radius[idx[2]], radius[idx[1]], radius[idx[0]]);
+   #endif
+         __m256 ocx = _mm256_sub_ps(ox, cx), ocy = _mm256_sub_ps(oy, cy), ocz = _mm256_sub_ps(oz, cz);
+         __m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, ocx), _mm256_mul_ps(dy, ocy)), _mm256_mul_ps(dz, ocz));
+         __m256 qx = _mm256_sub_ps(ocx, _mm256_mul_ps(b, dx));
+         __m256 qy = _mm256_sub_ps(ocy, _mm256_mul_ps(b, dy));
+         __m256 qz = _mm256_sub_ps(ocz, _mm256_mul_ps(b, dz));
+         __m256 disc = _mm256_sub_ps(_mm256_mul_ps(rad, rad),
+            _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(qx, qx), _mm256_mul_ps(qy, qy)), _mm256_mul_ps(qz, qz)));
+         __m256 t = _mm256_sub_ps(_mm256_sub_ps(zero, b), _mm256_sqrt_ps(_mm256_max_ps(disc, zero)));
+         __m256 mask = _mm256_and_ps(_mm256_cmp_ps(disc, zero, _CMP_GT_OQ),
+            _mm256_and_ps(_mm256_cmp_ps(t, lower, _CMP_GT_OQ), _mm256_cmp_ps(t, _mm256_set1_ps(best), _CMP_LT_OQ)));
+         int bits = _mm256_movemask_ps(mask);
+         if (bits != 0) {
+            float ts[8];
+            _mm256_storeu_ps(ts, t);
+            for (int l = 0; l < 8; l++) {
+               if ((bits >> l) & 1 && ts[l] < best) {
+                  best = ts[l];
+                  bestIdx = idx[l];
+               }
+            }
+         }
+      }
+   }
+#endif
+#ifdef __SSE2__
+   if (width >= 4) {
+      __m128 ox = _mm_set1_ps(r.origin.x), oy = _mm_set1_ps(r.origin.y), oz = _mm_set1_ps(r.origin.z);
+      __m128 dx = _mm_set1_ps(r.dir.x), dy = _mm_set1_ps(r.dir.y), dz = _mm_set1_ps(r.dir.z);
+      __m128 lower = _mm_set1_ps(t0), zero = _mm_setzero_ps();
+      for (; k + 4 <= count; k += 4) {
+         int idx[4] = {(int) prims[k], (int) prims[k + 1], (int) prims[k + 2], (int) prims[k + 3]};
+         __m128 cx = _mm_set_ps(centerX[idx[3]], centerX[idx[2]], centerX[idx[1]], centerX[idx[0]]);
+         __m128 cy = _mm_set_ps(centerY[idx[3]], centerY[idx[2]], centerY[idx[1]], centerY[idx[0]]);
+         __m128 cz = _mm_set_ps(centerZ[idx[3]], centerZ[idx[2]], centerZ[idx[1]], centerZ[idx[0]]);
+         __m128 rad = _mm_set_ps(radius[idx[3]], radius[idx[2]], radius[idx[1]], radius[idx[0]]);
+         __m128 ocx = _mm_sub_ps(ox, cx), ocy = _mm_sub_ps(oy, cy), ocz = _mm_sub_ps(oz, cz);
+         __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, ocx), _mm_mul_ps(dy, ocy)), _mm_mul_ps(dz, ocz));
+         __m128 qx = _mm_sub_ps(ocx, _mm_mul_ps(b, dx));
+         __m128 qy = _mm_sub_ps(ocy, _mm_mul_ps(b, dy));
+         __m128 qz = _mm_sub_ps(ocz, _mm_mul_ps(b, dz));
+         __m128 disc = _mm_sub_ps(_mm_mul_ps(rad, rad),
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(qx, qx), _mm_mul_ps(qy, qy)), _mm_mul_ps(qz, qz)));
+         __m128 t = _mm_sub_ps(_mm_sub_ps(zero, b), _mm_sqrt_ps(_mm_max_ps(disc, zero)));
+         __m128 mask = _mm_and_ps(_mm_cmpgt_ps(disc, zero),
+            _mm_and_ps(_mm_cmpgt_ps(t, lower), _mm_cmplt_ps(t, _mm_set1_ps(best))));
+         int bits = _mm_movemask_ps(mask);
+         if (bits != 0) {
+            float ts[4];
+            _mm_storeu_ps(ts, t);
+            for (int l = 0; l < 4; l++) {
+               if ((bits >> l) & 1 && ts[l] < best) {
+                  best = ts[l];
+                  bestIdx = idx[l];
+               }
+            }
+         }
+      }
+   }
+#endif
+   for (; k < count; k++) {
+      int i = prims[k];
+      float ocx = r.origin.x - centerX[i], ocy = r.origin.y - centerY[i], ocz = r.origin.z - centerZ[i];
+      float b = r.dir.x * ocx + r.dir.y * ocy + r.dir.z * ocz;
+      float qx = ocx - b * r.dir.x, qy = ocy - b * r.dir.y, qz = ocz - b * r.dir.z;
+      float disc = radius[i] * radius[i] - (qx * qx + qy * qy + qz * qz);
+      if (disc > 0.0) {
+         float t = -b - std::sqrt(disc);
+         if (t > t0 && t < best) {
+            best = t;
+            bestIdx = i;
+         }
+      }
+   }
+   if (bestIdx < 0) {
+      return false;
+   }
+   rec = HitRecord(best);
+   rec.index = bestIdx;
+   return true;
+}
+
+void SphereSet::completeHit(Ray& r, HitRecord& rec) {
+   Vector3 c(centerX[rec.index], centerY[rec.index], centerZ[rec.index]);
+   rec.pos = r.val(rec.t);
+   rec.normal = (rec.pos - c).normalized();
+   rec.materialId = materialIds[rec.index];
+}
+
 ////////////////
 // Hit Record //
 ////////////////
 HitRecord::HitRecord() {
    t = -1.0;
    hit = false;
+   index = 0;
+   surface = NULL;
+   materialId = 0;
+   u = 0.0;
+   v = 0.0;
 }
 
 HitRecord::HitRecord(float tIn) {
    t = tIn;
    hit = true;
+   index = 0;
+   surface = NULL;
+   materialId = 0;
+   u = 0.0;
+   v = 0.0;
+}
+
+///////////
+// Light //
+///////////
+Light::~Light() {
+
 }
 
 ///////////////////////
@@ -381,144 +860,2405 @@ DirectionalLight::DirectionalLight(float intensityIn, Vector3 dirIn) {
    dir = dirIn.normalized();
 }
 
-///////////
-// Scene // 
-///////////
-Scene::Scene(float distToCamIn, Vector3 viewPoint, Vector3 up, Vector3 viewDir, 
-   float tIn, float bIn, float lIn, float rIn, int nxIn, int nyIn, DirectionalLight lightSourceIn) {
-   orthographic = true;
-   orthoCam = OrthographicCamera(viewPoint, up, viewDir, tIn, bIn, lIn, rIn, nxIn, nyIn);
-   perCam = PerspectiveCamera(distToCamIn, viewPoint + Vector3(0.0, -8.0, -40.0), up, viewDir, tIn, bIn, lIn, rIn, nxIn, nyIn);
-   if (orthographic) {
-      cam = &orthoCam;
-   }
-   else{
-      cam = &perCam;
-   }
-   lightSource = lightSourceIn;
-   createSurfaces();
+bool DirectionalLight::illuminate(Vector3 /* pos */, Vector3& dirOut, float& dist, float& arriving) {
+   dirOut = dir;
+   dist = INFINITY;
+   arriving = intensity;
+   return true;
 }
 
-void Scene::createSurfaces() {
-   // create materials
-   float surfaceIntensity = 0.4;
-   float specularIntensity = 0.4;
-   float ambientIntensity = 0.2;
-   float phongExp = 100.0;
-   Color red(255, 0, 0), green(0, 255, 0), blue(0, 0, 255), white(255, 255, 255), black(0, 0, 0);
-   Material sphere1Mat(red, white, red, surfaceIntensity, specularIntensity, ambientIntensity, phongExp);
-   Material sphere2Mat(green, white, green, surfaceIntensity, specularIntensity, ambientIntensity, phongExp); 
-   Material tetraMat(blue, white, blue, surfaceIntensity, specularIntensity, ambientIntensity, phongExp);
-   Material planeMat(white, white, white, surfaceIntensity, specularIntensity, ambientIntensity, phongExp);
-   planeMat.glazed = true;
+BoundingBox DirectionalLight::bounds() {
+   return BoundingBox::infinite();
+}
 
-   // create spheres
-   float radius1 = 3.0, radius2 = 1.0;
-   Vector3 center1(0.0, radius1, -7.0), center2(2.0, radius2, 0.0);
-   Sphere* sphere1 = new Sphere(radius1, center1, sphere1Mat);
-   Sphere* sphere2 = new Sphere(radius2, center2, sphere2Mat);
+/////////////////
+// Point Light //
+/////////////////
+PointLight::PointLight() {
+   intensity = 1.0;
+   range = 1.0;
+}
 
-   // make tetrahedron
-   Vector3 t1(-9.0, 0.0, -3.0), t2(-6.0, 0.0, 0.0), t3(-4.0, 0.0, -4.0), t4(-7.0, 5.0, -2.0);
-   Triangle* front = new Triangle(t1, t2, t4, tetraMat);
-   Triangle* bottom = new Triangle(t1, t3, t2, tetraMat);
-   Triangle* left = new Triangle(t4, t3, t1, tetraMat);
-   Triangle* right = new Triangle(t3, t4, t2, tetraMat);
+PointLight::PointLight(float intensityIn, Vector3 positionIn, float rangeIn) {
+   intensity = intensityIn;
+   position = positionIn;
+   range = rangeIn;
+}
 
-   // make plane
-   Vector3 p1(0.0, 0.0, 10.0), p2(5.0, 0.0, 10.0), p3(2.5, 0.0, -5.0);
-   Plane* plane = new Plane(p1, p2, p3, planeMat);
+bool PointLight::illuminate(Vector3 pos, Vector3& dir, float& dist, float& arriving) {
+   Vector3 toLight = position - pos;
+   float squared = Vector3::dot(toLight, toLight);
+   float falloff = 1.0f - squared / (range * range);
+   if (falloff <= 0.0 || squared == 0.0) {
+      return false;
+   }
+   dist = sqrt(squared);
+   dir = toLight / dist;
+   arriving = intensity * falloff * falloff;
+   return true;
+}
 
-   // add each surface to surface list
-   surfaces.push_back(sphere1);
-   surfaces.push_back(sphere2);
-   surfaces.push_back(front);
-   surfaces.push_back(bottom);
-   surfaces.push_back(left);
-   surfaces.push_back(right);
-   surfaces.push_back(plane);
+BoundingBox PointLight::bounds() {
+   Vector3 reach(range, range, range);
+   return BoundingBox(position - reach, position + reach);
 }
 
-void Scene::render(unsigned char* image, int width, int height, float tmin, float tmax) {
-   for(int i = 0; i < height; i++) {
-      for (int j = 0; j < width; j++) {
-         int idx = (i * width + j) * 3;
-         Ray viewRay = cam->viewRay(j, i);
-         Color idxColor = rayColor(viewRay, tmin, tmax);
-         if (j == 256 && i == 256) {
-            printDetails = true;
-         }
-         else {
-            printDetails = false;
-         }
-         image[idx] = idxColor.red;
-         image[idx+1] = idxColor.green;
-         image[idx+2] = idxColor.blue;
-      }
+////////////////
+// Spot Light //
+////////////////
+SpotLight::SpotLight(float intensityIn, Vector3 positionIn, float rangeIn, Vector3 dirIn, float innerAngle, float outerAngle) {
+   intensity = intensityIn;
+   position = positionIn;
+   range = rangeIn;
+   dir = dirIn.normalized();
+   cosInner = cos(innerAngle);
+   cosOuter = cos(outerAngle);
+}
+
+bool SpotLight::illuminate(Vector3 pos, Vector3& dirOut, float& dist, float& arriving) {
+   if (!PointLight::illuminate(pos, dirOut, dist, arriving)) {
+      return false;
+   }
+   float cosAxis = -Vector3::dot(dirOut, dir);
+   if (cosAxis <= cosOuter) {
+      return false;
    }
+   if (cosAxis < cosInner) {
+      // smoothstep across the edge of the cone
+      float edge = (cosAxis - cosOuter) / (cosInner - cosOuter);
+      arriving *= edge * edge * (3.0f - 2.0f * edge);
+   }
+   return true;
 }
 
-void Scene::switchCamera() {
-   if (orthographic) {
-      cam = &perCam;
-      std::cout << "Switching to perspective camera." << std::endl;
+//////////////////
+// Sphere Light //
+//////////////////
+SphereLight::SphereLight(Sphere* sphereIn, float intensityIn) {
+   sphere = sphereIn;
+   intensity = intensityIn;
+}
+
+bool SphereLight::illuminate(Vector3 pos, Vector3& dir, float& dist, float& arriving) {
+   Vector3 toCenter = sphere->center - pos;
+   float d = toCenter.magnitude();
+   if (d <= sphere->radius) {
+      return false;
    }
-   else {
-      cam = &orthoCam;
-      std::cout << "Switching to orthographic camera." << std::endl;
+   dir = toCenter / d;
+   dist = d - sphere->radius;
+   arriving = intensity;
+   return true;
+}
+
+BoundingBox SphereLight::bounds() {
+   return BoundingBox::infinite();
+}
+
+bool SphereLight::sample(Vector3 pos, float u1, float u2, Vector3& dir, float& dist) {
+   Vector3 toCenter = sphere->center - pos;
+   float d = toCenter.magnitude();
+   float r = sphere->radius;
+   if (d <= r) {
+      return false;
    }
-   orthographic = !orthographic;
+   // frame around the direction to the centre
+   Vector3 w = toCenter / d;
+   Vector3 helper = fabs(w.x) > 0.9f ? Vector3(0.0, 1.0, 0.0) : Vector3(1.0, 0.0, 0.0);
+   Vector3 u = Vector3::cross(helper, w).normalized();
+   Vector3 v = Vector3::cross(w, u);
+
+   // uniform in solid angle: cos(theta) uniform between cosMax and 1
+   float cosMax = sqrt(std::max(0.0f, 1.0f - r * r / (d * d)));
+   float cosTheta = 1.0f - u1 * (1.0f - cosMax);
+   float sinTheta = sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+   float phi = 2.0f * M_PI * u2;
+   dir = u * (cos(phi) * sinTheta) + v * (sin(phi) * sinTheta) + w * cosTheta;
+   // near intersection with the sphere, so the sphere does not block its own light
+   dist = d * cosTheta - sqrt(std::max(0.0f, r * r - d * d * sinTheta * sinTheta));
+   return true;
 }
 
-Color Scene::rayColor(Ray r, float t0, float tf) {
-   Surface *hitSurface;
-   HitRecord rec;
-   float t = tf;
-   for (int k = 0; k < surfaces.size(); k++) {
-      if (surfaces.at(k)->hit(r, t0, t, rec)) {
-         hitSurface = surfaces.at(k);
-         t = rec.t;
+////////////////
+// Light Tree //
+////////////////
+void LightTree::build(std::vector<Light*>& lights) {
+   unbounded.clear();
+   bounded.clear();
+   boxes.clear();
+   nodes.clear();
+   std::vector<BoundingBox> lightBoxes;
+   std::vector<Light*> lightsIn;
+   for (int k = 0; k < lights.size(); k++) {
+      BoundingBox box = lights[k]->bounds();
+      if (box.bounded()) {
+         lightsIn.push_back(lights[k]);
+         lightBoxes.push_back(box);
       }
+      else {
+         unbounded.push_back(lights[k]);
+      }
+   }
+   if (lightsIn.empty()) {
+      return;
    }
-   if (rec.hit) {
-      // add ambient shading
-      Vector3 pos = r.val(rec.t);
-      Color c = hitSurface->material.ambientColor * hitSurface->material.ambientIntensity;
+   std::vector<int> order(lightsIn.size());
+   for (int k = 0; k < order.size(); k++) {
+      order[k] = k;
+   }
+   boxes = lightBoxes;
+   buildNode(order, 0, order.size());
+   // leaves refer to ranges of the sorted order
+   for (int k = 0; k < order.size(); k++) {
+      bounded.push_back(lightsIn[order[k]]);
+      boxes[k] = lightBoxes[order[k]];
+   }
+}
 
-      // see if object is in shadow of another object
-      Ray shadowRay(pos, lightSource.dir);
-      HitRecord shadowRec;
+int LightTree::buildNode(std::vector<int>& order, int first, int count) {
+   int node = nodes.size();
+   nodes.push_back(LightNode());
+   BoundingBox box, centers;
+   for (int k = first; k < first + count; k++) {
+      box.expand(boxes[order[k]]);
+      centers.expand((boxes[order[k]].min + boxes[order[k]].max) * 0.5);
+   }
+   nodes[node].box = box;
+   if (count <= LEAF_SIZE) {
+      nodes[node].first = first;
+      nodes[node].count = count;
+      return node;
+   }
+   // median split along the axis the centers spread out most on
+   Vector3 spread = centers.extent();
+   int axis = spread.x >= spread.y && spread.x >= spread.z ? 0 : (spread.y >= spread.z ? 1 : 2);
+   std::vector<BoundingBox>& b = boxes;
+   std::nth_element(order.begin() + first, order.begin() + first + count / 2, order.begin() + first + count,
+      [&b, axis](int i, int j) {
+         float ci[3] = {b[i].min.x + b[i].max.x, b[i].min.y + b[i].max.y, b[i].min.z + b[i].max.z};
+         float cj[3] = {b[j].min.x + b[j].max.x, b[j].min.y + b[j].max.y, b[j].min.z + b[j].max.z};
+         return ci[axis] < cj[axis];
+      });
+   buildNode(order, first, count / 2);
+   int right = buildNode(order, first + count / 2, count - count / 2);
+   nodes[node].first = right;
+   nodes[node].count = 0;
+   return node;
+}
 
-      for (int k = 0; k < surfaces.size(); k++) {
-         // ignore the shadow of the sun
-         if (k == 7) {
-            continue;
-         }
-         if (surfaces.at(k)->hit(shadowRay, t0, tf, shadowRec)) {
-            break;
+void LightTree::query(Vector3 pos, std::vector<Light*>& out) {
+   out.insert(out.end(), unbounded.begin(), unbounded.end());
+   if (nodes.empty()) {
+      return;
+   }
+   // median splits keep the depth near log2 of the light count
+   int stack[64];
+   int top = 0;
+   stack[top++] = 0;
+   while (top > 0) {
+      int node = stack[--top];
+      LightNode& n = nodes[node];
+      if (!n.box.contains(pos)) {
+         continue;
+      }
+      if (n.count > 0) {
+         for (int k = n.first; k < n.first + n.count; k++) {
+            if (boxes[k].contains(pos)) {
+               out.push_back(bounded[k]);
+            }
          }
       }
-
-      // if an object is not in a shadow, add specular and diffuse shading
-      if (!shadowRec.hit) {
-         Vector3 normal = hitSurface->normal(r.val(t));
-         Vector3 h = (r.dir * -1.0 + lightSource.dir).normalized();
-         float d = hitSurface->material.surfaceIntensity * lightSource.intensity 
-            * std::max(0.0f, Vector3::dot(normal.normalized(), lightSource.dir.normalized()));
-         float s = hitSurface->material.specularIntensity * lightSource.intensity 
-            * pow(std::max(0.0f, Vector3::dot(normal, h)), hitSurface->material.phongExp);
-         c = c + hitSurface->material.surfaceColor * d + hitSurface->material.surfaceColor * s;
+      else {
+         stack[top++] = n.first;
+         stack[top++] = node + 1;
       }
+   }
+}
 
-      if (hitSurface->material.glazed) {
-         Vector3 normal = hitSurface->normal(r.val(t));
-         Ray mr(r.val(t), r.dir - normal * 2 * Vector3::dot(r.dir, normal));
-         Color reflectedColor = hitSurface->material.specularColor / 255.0f 
-            * rayColor(mr, t0, tf) * hitSurface->material.specularIntensity;
-         return c + reflectedColor;
-      }
+size_t LightTree::memoryBytes() {
+   return (unbounded.capacity() + bounded.capacity()) * sizeof(Light*) + boxes.capacity() * sizeof(BoundingBox) +
+      nodes.capacity() * sizeof(LightNode);
+}
 
-      return c;
+/////////////
+// Sampler //
+/////////////
+// well mixed bits of the hit position, so the same hit picks the same lights every frame
+static unsigned hitSeed(Vector3 pos, int depth) {
+   unsigned bits[3];
+   memcpy(bits, &pos, sizeof(bits));
+   unsigned h = 2166136261u ^ depth;
+   for (int k = 0; k < 3; k++) {
+      h = (h ^ bits[k]) * 16777619u;
+   }
+   h ^= h >> 16;
+   h *= 0x85ebca6bu;
+   h ^= h >> 13;
+   return h;
+}
+
+// uniform in [0, 1), xorshift32
+static float nextRandom(unsigned& state) {
+   state ^= state << 13;
+   state ^= state >> 17;
+   state ^= state << 5;
+   return (state >> 8) * (1.0f / 16777216.0f);
+}
+
+// mixes v into the hash h
+static unsigned hashCombine(unsigned h, unsigned v) {
+   h ^= v + 0x9e3779b9u + (h << 6) + (h >> 2);
+   h ^= h >> 16;
+   h *= 0x85ebca6bu;
+   h ^= h >> 13;
+   h *= 0xc2b2ae35u;
+   h ^= h >> 16;
+   return h;
+}
+
+static unsigned reverseBits(unsigned x) {
+   x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+   x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+   x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+   x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+   return (x >> 16) | (x << 16);
+}
+
+// base 2 Owen scrambling as a hash: Laine and Karras' permutation with Burley's constants,
+// applied to the reversed bits so that each bit only depends on the ones above it
+static unsigned owenScramble(unsigned x, unsigned seed) {
+   x = reverseBits(x);
+   x += seed;
+   x ^= x * 0x6c50b47cu;
+   x ^= x * 0xb82f1e52u;
+   x ^= x * 0xc7afe638u;
+   x ^= x * 0x8d22f6e6u;
+   return reverseBits(x);
+}
+
+// the top 24 bits as a float, which stays below 1
+static float toUnit(unsigned x) {
+   return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+// direction numbers of the first two Sobol dimensions, 32 each: the van der Corput sequence
+// and the one from the primitive polynomial x + 1
+static std::vector<unsigned> buildSobol() {
+   std::vector<unsigned> v(2 * 32);
+   for (int k = 0; k < 32; k++) {
+      v[k] = 1u << (31 - k);
+      v[32 + k] = k == 0 ? v[k] : v[32 + k - 1] ^ (v[32 + k - 1] >> 1);
+   }
+   return v;
+}
+
+static unsigned sobol(unsigned index, int dim) {
+   // built on first use, which C++ makes safe from any thread
+   static std::vector<unsigned> directions = buildSobol();
+   const unsigned* v = &directions[dim * 32];
+   unsigned x = 0;
+   for (int k = 0; index != 0; index >>= 1, k++) {
+      if (index & 1) {
+         x ^= v[k];
+      }
+   }
+   return x;
+}
+
+// one of the 1D strata of width 1 / strata inside [first, first + count), free if there is one
+static int freeStratum(std::vector<bool>& taken, int first, int count, unsigned& state) {
+   int start = std::min(count - 1, (int) (nextRandom(state) * count));
+   for (int k = 0; k < count; k++) {
+      int stratum = first + (start + k) % count;
+      if (!taken[stratum]) {
+         return stratum;
+      }
+   }
+   return first + start;
+}
+
+// puts point idx into quarter (xHalf, yHalf) of cell (i, j) of a side x side grid, in a row
+// and column of width 1 / strata that no point has yet
+static void placePmj(float* points, int idx, int i, int j, int xHalf, int yHalf, int side, int strata,
+   std::vector<bool>& xTaken, std::vector<bool>& yTaken, unsigned& state) {
+   int count = strata / (2 * side);
+   int x = freeStratum(xTaken, (2 * i + xHalf) * count, count, state);
+   int y = freeStratum(yTaken, (2 * j + yHalf) * count, count, state);
+   xTaken[x] = true;
+   yTaken[y] = true;
+   points[2 * idx] = std::min((x + nextRandom(state)) / strata, 0.99999994f);
+   points[2 * idx + 1] = std::min((y + nextRandom(state)) / strata, 0.99999994f);
+}
+
+static void markStrata(float* points, int count, int strata, std::vector<bool>& xTaken, std::vector<bool>& yTaken) {
+   xTaken.assign(strata, false);
+   yTaken.assign(strata, false);
+   for (int k = 0; k < count; k++) {
+      xTaken[(int) (points[2 * k] * strata)] = true;
+      yTaken[(int) (points[2 * k + 1] * strata)] = true;
+   }
+}
+
+// progressive multi-jittered points (Christensen, Kensler and Kilpatrick): each first 4^k
+// points have one point in every cell of a 2^k x 2^k grid, and each first 2^k points one in
+// every one of 2^k rows and columns
+static void buildPmj(float* points, int count, unsigned seed) {
+   std::vector<bool> xTaken, yTaken;
+   unsigned state = seed != 0 ? seed : 1;
+   points[0] = nextRandom(state);
+   points[1] = nextRandom(state);
+   for (int n = 1; n < count; n *= 4) {
+      int side = (int) (sqrt((float) n) + 0.5f);
+      // the n points so far get a partner in the diagonally opposite quarter of their cell,
+      // then the other two quarters are filled, the one to go first picked at random
+      markStrata(points, n, 2 * n, xTaken, yTaken);
+      for (int k = 0; k < n && n + k < count; k++) {
+         float x = points[2 * k] * side, y = points[2 * k + 1] * side;
+         int i = (int) x, j = (int) y;
+         placePmj(points, n + k, i, j, 1 - (int) (2 * (x - i)), 1 - (int) (2 * (y - j)), side, 2 * n, xTaken, yTaken, state);
+      }
+      if (2 * n >= count) {
+         break;
+      }
+      markStrata(points, 2 * n, 4 * n, xTaken, yTaken);
+      for (int k = 0; k < n && 2 * n + k < count; k++) {
+         float x = points[2 * k] * side, y = points[2 * k + 1] * side;
+         int i = (int) x, j = (int) y;
+         int xHalf = (int) (2 * (x - i)), yHalf = (int) (2 * (y - j));
+         if (nextRandom(state) < 0.5) {
+            xHalf = 1 - xHalf;
+         }
+         else {
+            yHalf = 1 - yHalf;
+         }
+         placePmj(points, 2 * n + k, i, j, xHalf, yHalf, side, 4 * n, xTaken, yTaken, state);
+         if (3 * n + k < count) {
+            placePmj(points, 3 * n + k, i, j, 1 - xHalf, 1 - yHalf, side, 4 * n, xTaken, yTaken, state);
+         }
+      }
+   }
+}
+
+static std::vector<float> buildPmjSets() {
+   std::vector<float> points(2 * Sampler::PMJ_SETS * Sampler::PMJ_POINTS);
+   for (int k = 0; k < Sampler::PMJ_SETS; k++) {
+      buildPmj(&points[2 * k * Sampler::PMJ_POINTS], Sampler::PMJ_POINTS, hashCombine(0x504d4au, k));
+   }
+   return points;
+}
+
+static const float* pmjPoints() {
+   static std::vector<float> points = buildPmjSets();
+   return points.data();
+}
+
+Sampler::Sampler() {
+   kind = SAMPLER_SOBOL;
+   seed = 0;
+}
+
+Sampler::Sampler(SamplerKind kindIn, unsigned seedIn) {
+   kind = kindIn;
+   seed = seedIn;
+}
+
+float Sampler::get1D(int pixel, int index, int dim) {
+   if (kind == SAMPLER_SOBOL) {
+      // every pair of dimensions is the first two Sobol dimensions, a (0, 2) sequence,
+      // scrambled independently; scrambling the index as well shuffles the order of the
+      // points without breaking up power of two prefixes
+      unsigned block = hashCombine(hashCombine(seed, pixel), dim / 2);
+      unsigned shuffled = owenScramble(index, block);
+      return toUnit(owenScramble(sobol(shuffled, dim % 2), hashCombine(block, dim % 2)));
+   }
+   if (kind == SAMPLER_PMJ) {
+      float u, v;
+      get2D(pixel, index, dim & ~1, u, v);
+      return dim & 1 ? v : u;
+   }
+   return toUnit(hashCombine(hashCombine(hashCombine(seed, pixel), index), dim));
+}
+
+void Sampler::get2D(int pixel, int index, int dim, float& u, float& v) {
+   if (kind != SAMPLER_PMJ) {
+      u = get1D(pixel, index, dim);
+      v = get1D(pixel, index, dim + 1);
+      return;
+   }
+   // every PMJ_POINTS samples move on to a set and shift of their own
+   unsigned h = hashCombine(hashCombine(hashCombine(seed, pixel), dim), index / PMJ_POINTS);
+   const float* point = pmjPoints() + 2 * ((h % PMJ_SETS) * PMJ_POINTS + index % PMJ_POINTS);
+   u = point[0] + toUnit(hashCombine(h, 1));
+   v = point[1] + toUnit(hashCombine(h, 2));
+   u = std::min(u >= 1.0f ? u - 1.0f : u, 0.99999994f);
+   v = std::min(v >= 1.0f ? v - 1.0f : v, 0.99999994f);
+}
+
+/////////////////////
+// Sample Sequence //
+/////////////////////
+SampleSequence::SampleSequence(Sampler* samplerIn, int pixelIn, int indexIn) {
+   sampler = samplerIn;
+   pixel = pixelIn;
+   index = indexIn;
+   dim = 0;
+}
+
+float SampleSequence::next() {
+   return sampler->get1D(pixel, index, dim++);
+}
+
+void SampleSequence::next2D(float& u, float& v) {
+   dim += dim & 1;
+   sampler->get2D(pixel, index, dim, u, v);
+   dim += 2;
+}
+
+/////////////////
+// Pixel Probe //
+/////////////////
+static std::ostream& operator<<(std::ostream& out, const Vector3& v) {
+   return out << "(" << v.x << ", " << v.y << ", " << v.z << ")";
+}
+
+static std::ostream& operator<<(std::ostream& out, const Color& c) {
+   return out << "(" << (int) c.red << ", " << (int) c.green << ", " << (int) c.blue << ")";
+}
+
+void PixelProbe::addRay(int depth, Ray& r) {
+   ProbeEvent e;
+   e.type = PROBE_RAY;
+   e.depth = depth;
+   e.origin = r.origin;
+   e.dir = r.dir;
+   events.push_back(e);
+}
+
+void PixelProbe::addHit(int depth, HitRecord& rec, int surfaceIndex) {
+   ProbeEvent e;
+   e.type = PROBE_HIT;
+   e.depth = depth;
+   e.hit = rec;
+   e.surfaceIndex = surfaceIndex;
+   events.push_back(e);
+}
+
+void PixelProbe::addMiss(int depth) {
+   ProbeEvent e;
+   e.type = PROBE_MISS;
+   e.depth = depth;
+   events.push_back(e);
+}
+
+void PixelProbe::addShadow(int depth, Ray& r, bool occluded) {
+   ProbeEvent e;
+   e.type = PROBE_SHADOW;
+   e.depth = depth;
+   e.origin = r.origin;
+   e.dir = r.dir;
+   e.occluded = occluded;
+   events.push_back(e);
+}
+
+void PixelProbe::addShade(int depth, Color local, Color reflected, Color result) {
+   ProbeEvent e;
+   e.type = PROBE_SHADE;
+   e.depth = depth;
+   e.local = local;
+   e.reflected = reflected;
+   e.result = result;
+   events.push_back(e);
+}
+
+void PixelProbe::print(std::ostream& out) {
+   out << "pixel (" << x << ", " << y << ") color " << color << std::endl;
+   for (int k = 0; k < events.size(); k++) {
+      ProbeEvent& e = events[k];
+      out << std::string(2 * e.depth + 2, ' ') << "[" << e.depth << "] ";
+      if (e.type == PROBE_RAY) {
+         out << "ray     origin " << e.origin << " dir " << e.dir;
+      }
+      else if (e.type == PROBE_HIT) {
+         out << "hit     t " << e.hit.t << " surface " << e.surfaceIndex;
+         if (e.hit.surface != NULL && e.hit.surface->primitiveCount() > 1) {
+            out << "/" << e.hit.index;
+         }
+         out << " material " << e.hit.materialId << " pos " << e.hit.pos << " normal " << e.hit.normal;
+      }
+      else if (e.type == PROBE_MISS) {
+         out << "miss";
+      }
+      else if (e.type == PROBE_SHADOW) {
+         out << "shadow  origin " << e.origin << " dir " << e.dir << (e.occluded ? " occluded" : " lit");
+      }
+      else {
+         out << "shade   local " << e.local << " reflected " << e.reflected << " result " << e.result;
+      }
+      out << std::endl;
+   }
+}
+
+//////////////
+// G-Buffer //
+//////////////
+GBuffer::GBuffer() {
+   cam = NULL;
+   width = 0;
+   height = 0;
+   tileSize = 0;
+   tmin = 0.0;
+   tmax = 0.0;
+}
+
+bool GBuffer::update(Scene& scene, int widthIn, int heightIn, float tminIn, float tmaxIn, int tileSizeIn) {
+   std::vector<float> viewIn;
+   scene.cam->parameters(viewIn);
+   std::vector<bool> glazedIn;
+   for (int k = 0; k < scene.materials.size(); k++) {
+      glazedIn.push_back(scene.materials[k].glazed);
+   }
+   // a new view, image layout or ray interval changes every primary ray, and a material
+   // that starts or stops reflecting changes the length of chains
+   bool valid = cam == scene.cam && view == viewIn && width == widthIn && height == heightIn &&
+      tmin == tminIn && tmax == tmaxIn && tileSize == tileSizeIn && glazed == glazedIn;
+   cam = scene.cam;
+   view = viewIn;
+   width = widthIn;
+   height = heightIn;
+   tmin = tminIn;
+   tmax = tmaxIn;
+   tileSize = tileSizeIn;
+   glazed = glazedIn;
+
+   // surfaces are matched by position in Scene::surfaces, so a reordered list counts as
+   // every moved entry changing
+   changedSurfaces.clear();
+   changedBounds.clear();
+   int count = std::max(surfaces.size(), scene.surfaces.size());
+   std::vector<float> data;
+   for (int k = 0; k < count; k++) {
+      Surface* now = k < scene.surfaces.size() ? scene.surfaces[k] : NULL;
+      data.clear();
+      if (now != NULL) {
+         now->geometry(data);
+      }
+      if (k < surfaces.size() && now == surfaces[k] && data == geometry[k]) {
+         continue;
+      }
+      if (k < surfaces.size()) {
+         changedSurfaces.push_back(surfaces[k]);
+         changedBounds.push_back(bounds[k]);
+      }
+      if (now != NULL) {
+         changedSurfaces.push_back(now);
+         changedBounds.push_back(now->bounds());
+      }
+   }
+   for (int k = 0; k < changedBounds.size(); k++) {
+      // an unbounded surface that changed may cross any ray
+      valid = valid && changedBounds[k].bounded();
+   }
+   surfaces = scene.surfaces;
+   geometry.resize(surfaces.size());
+   bounds.resize(surfaces.size());
+   for (int k = 0; k < surfaces.size(); k++) {
+      geometry[k].clear();
+      surfaces[k]->geometry(geometry[k]);
+      bounds[k] = surfaces[k]->bounds();
+   }
+
+   int tilesX = (width + tileSize - 1) / tileSize;
+   int tilesY = (height + tileSize - 1) / tileSize;
+   if (!valid) {
+      tiles.assign(tilesX * tilesY, std::vector<GBufferHit>());
+      lengths.assign(width * height, 0);
+   }
+   return valid;
+}
+
+bool GBuffer::stale(const GBufferHit* hits, int count, Vector3 origin) {
+   for (int k = 0; k < count; k++) {
+      Ray r(origin, hits[k].dir);
+      for (int c = 0; c < changedSurfaces.size(); c++) {
+         float tEnter, tExit;
+         if (hits[k].surface == changedSurfaces[c] || changedBounds[c].hit(r, tmin, hits[k].t, tEnter, tExit)) {
+            return true;
+         }
+      }
+      origin = hits[k].pos;
+   }
+   return false;
+}
+
+size_t GBuffer::memoryBytes() {
+   size_t bytes = tiles.capacity() * sizeof(std::vector<GBufferHit>) + lengths.capacity();
+   for (int k = 0; k < tiles.size(); k++) {
+      bytes += tiles[k].capacity() * sizeof(GBufferHit);
+   }
+   for (int k = 0; k < geometry.size(); k++) {
+      bytes += geometry[k].capacity() * sizeof(float);
+   }
+   return bytes;
+}
+
+//////////////////
+// Reprojection //
+//////////////////
+Reprojection::Reprojection() {
+   cam = NULL;
+   curCam = NULL;
+   width = 0;
+   height = 0;
+   geometry = 0;
+   shadowsValid = false;
+}
+
+bool Reprojection::update(Scene& scene, unsigned long long geometryIn, int widthIn, int heightIn) {
+   bool valid = cam != NULL && width == widthIn && height == heightIn && geometry == geometryIn;
+   std::vector<bool> castersIn(scene.surfaces.size());
+   for (int k = 0; k < scene.surfaces.size(); k++) {
+      castersIn[k] = scene.surfaces[k]->castsShadow;
+   }
+   Vector3 lightDirIn = scene.lightSource.dir;
+   shadowsValid = valid && casters == castersIn && lightDir.x == lightDirIn.x && lightDir.y == lightDirIn.y && lightDir.z == lightDirIn.z;
+   casters.swap(castersIn);
+   lightDir = lightDirIn;
+   width = widthIn;
+   height = heightIn;
+   geometry = geometryIn;
+   nextSurfaces.assign(width * height, NULL);
+   nextPrims.assign(width * height, 0);
+   nextPositions.resize(width * height);
+   nextShadows.assign(width * height, -1);
+   if (!valid) {
+      surfaces.assign(width * height, NULL);
+      return false;
+   }
+
+   // each old hit is splatted onto the four pixel centres around where it lands in the new
+   // view, so a surface coming closer leaves no holes; the hit nearest the camera wins
+   guesses.assign(width * height, NULL);
+   guessPrims.assign(width * height, 0);
+   guessDepths.assign(width * height, INFINITY);
+   curCam = scene.cam;
+   for (int y = 0; y < height; y++) {
+      for (int x = 0; x < width; x++) {
+         int k = y * width + x;
+         if (surfaces[k] == NULL) {
+            continue;
+         }
+         float px, py, depth;
+         if (!curCam->project(positions[k], px, py, depth)) {
+            continue;
+         }
+         int x0 = (int) floor(px), y0 = (int) floor(py);
+         for (int n = 0; n < 4; n++) {
+            int nx = x0 + n % 2, ny = y0 + n / 2;
+            if (nx < 0 || ny < 0 || nx >= width || ny >= height) {
+               continue;
+            }
+            int g = ny * width + nx;
+            if (depth < guessDepths[g]) {
+               guesses[g] = surfaces[k];
+               guessPrims[g] = prims[k];
+               guessDepths[g] = depth;
+            }
+         }
+      }
+   }
+   return true;
+}
+
+bool Reprojection::sameHit(int k, Surface* surface, unsigned prim) {
+   return surfaces[k] == surface && prims[k] == prim;
+}
+
+bool Reprojection::reuse(int x, int y, Ray r, float t0, float tf, HitRecord& rec, int& lit) {
+   // the guesses on the outermost pixels lack neighbours to be checked against
+   if (x < 1 || y < 1 || x >= width - 1 || y >= height - 1) {
+      return false;
+   }
+   int k = y * width + x;
+   Surface* surface = guesses[k];
+   if (surface == NULL) {
+      return false;
+   }
+   unsigned prim = guessPrims[k];
+   HitRecord guess;
+   RT_STAT(primitiveTests);
+   if (!surface->hitPrimitives(&prim, 1, r, t0, tf, guess)) {
+      return false;
+   }
+
+   // in the new view nothing seen nearer may have landed next to the pixel, or it could be
+   // an edge coming over the guessed primitive
+   Vector3 pos = r.val(guess.t);
+   float px, py, depth;
+   if (!curCam->project(pos, px, py, depth) || std::fabs(depth - guessDepths[k]) > 0.01 * depth) {
+      return false;
+   }
+   for (int n = 0; n < 4; n++) {
+      int g = (y + (n == 2) - (n == 3)) * width + x + (n == 0) - (n == 1);
+      bool same = guesses[g] == surface && guessPrims[g] == prim;
+      if (guesses[g] == NULL || (!same && guessDepths[g] < 0.99 * depth)) {
+         return false;
+      }
+   }
+
+   // in the old view the hit has to lie inside the primitive's footprint, at least a pixel
+   // away from anything that covered or bordered it
+   if (!cam->project(pos, px, py, depth)) {
+      return false;
+   }
+   int ox = (int) floor(px + 0.5), oy = (int) floor(py + 0.5);
+   if (ox < 1 || oy < 1 || ox >= width - 1 || oy >= height - 1) {
+      return false;
+   }
+   int o = oy * width + ox;
+   if (!sameHit(o, surface, prim) || !sameHit(o - 1, surface, prim) || !sameHit(o + 1, surface, prim) ||
+      !sameHit(o - width, surface, prim) || !sameHit(o + width, surface, prim)) {
+      return false;
+   }
+
+   // the shadow carries over when the old pixel and its neighbours all agree on it
+   lit = -1;
+   if (shadowsValid) {
+      int s = shadows[o];
+      if (s >= 0 && shadows[o - 1] == s && shadows[o + 1] == s && shadows[o - width] == s && shadows[o + width] == s) {
+         lit = s;
+      }
+   }
+   rec = guess;
+   rec.surface = surface;
+   surface->completeHit(r, rec);
+   return true;
+}
+
+void Reprojection::store(int x, int y, const HitRecord& rec, int lit) {
+   int k = y * width + x;
+   nextSurfaces[k] = rec.surface;
+   nextPrims[k] = rec.index;
+   nextPositions[k] = rec.pos;
+   nextShadows[k] = lit;
+}
+
+void Reprojection::finish(Scene& scene) {
+   surfaces.swap(nextSurfaces);
+   prims.swap(nextPrims);
+   positions.swap(nextPositions);
+   shadows.swap(nextShadows);
+   orthoCam = scene.orthoCam;
+   perCam = scene.perCam;
+   if (scene.cam == &scene.orthoCam) {
+      cam = &orthoCam;
+   }
+   else if (scene.cam == &scene.perCam) {
+      cam = &perCam;
+   }
+   else {
+      // a camera the scene does not own cannot be copied
+      cam = NULL;
+   }
+}
+
+size_t Reprojection::memoryBytes() {
+   return (surfaces.capacity() + nextSurfaces.capacity() + guesses.capacity()) * sizeof(Surface*) +
+      (prims.capacity() + nextPrims.capacity() + guessPrims.capacity()) * sizeof(unsigned) +
+      (positions.capacity() + nextPositions.capacity()) * sizeof(Vector3) + shadows.capacity() + nextShadows.capacity() +
+      guessDepths.capacity() * sizeof(float) + casters.capacity() / 8;
+}
+
+////////////////
+// Shadow Map //
+////////////////
+ShadowMap::ShadowMap() {
+   u0 = 0.0;
+   v0 = 0.0;
+   texel = 0.0;
+   invTexel = 0.0;
+   nu = 0;
+   nv = 0;
+   builtSize = 0;
+   geometry = 0;
+}
+
+void ShadowMap::update(Scene& scene, unsigned long long geometryIn, int size) {
+   Vector3 light = scene.lightSource.dir.normalized();
+   std::vector<bool> castersIn(scene.surfaces.size());
+   for (int k = 0; k < scene.surfaces.size(); k++) {
+      castersIn[k] = scene.surfaces[k]->castsShadow;
+   }
+   if (size == builtSize && geometryIn == geometry && scene.surfaces == builtFrom && castersIn == casters &&
+      light.x == w.x && light.y == w.y && light.z == w.z) {
+      return;
+   }
+   builtSize = size;
+   geometry = geometryIn;
+   builtFrom = scene.surfaces;
+   casters.swap(castersIn);
+
+   // any two axes across the light will do
+   w = light;
+   Vector3 axis = std::fabs(w.x) < 0.9 ? Vector3(1.0, 0.0, 0.0) : Vector3(0.0, 1.0, 0.0);
+   u = Vector3::cross(axis, w).normalized();
+   v = Vector3::cross(w, u);
+
+   unbounded.clear();
+   float lo[3], hi[3];
+   float minU = INFINITY, minV = INFINITY, maxU = -INFINITY, maxV = -INFINITY;
+   for (int k = 0; k < scene.surfaces.size(); k++) {
+      Surface* surface = scene.surfaces[k];
+      if (!surface->castsShadow) {
+         continue;
+      }
+      if (!surface->bounds().bounded()) {
+         unbounded.push_back(surface);
+         continue;
+      }
+      for (int prim = 0; prim < surface->primitiveCount(); prim++) {
+         project(surface->primitiveBounds(prim), lo, hi);
+         minU = std::min(minU, lo[0]);
+         minV = std::min(minV, lo[1]);
+         maxU = std::max(maxU, hi[0]);
+         maxV = std::max(maxV, hi[1]);
+      }
+   }
+   if (minU > maxU) {
+      nu = 0;
+      nv = 0;
+      texels.clear();
+      corners.clear();
+      return;
+   }
+
+   // a texel of margin on every side keeps rounding at the outermost bounds inside the map
+   texel = std::max(std::max(maxU - minU, maxV - minV) / size, 1e-6f);
+   invTexel = 1.0 / texel;
+   u0 = minU - texel;
+   v0 = minV - texel;
+   nu = (int) ((maxU - minU) / texel) + 3;
+   nv = (int) ((maxV - minV) / texel) + 3;
+   ShadowTexel empty = {-INFINITY, -INFINITY, NULL, 0};
+   ShadowCorner uncovered = {NULL, 0, -INFINITY};
+   texels.assign(nu * nv, empty);
+   corners.assign((nu + 1) * (nv + 1), uncovered);
+   for (int k = 0; k < scene.surfaces.size(); k++) {
+      Surface* surface = scene.surfaces[k];
+      if (surface->castsShadow && surface->bounds().bounded()) {
+         for (int prim = 0; prim < surface->primitiveCount(); prim++) {
+            rasterize(surface, prim);
+         }
+      }
+   }
+}
+
+void ShadowMap::project(BoundingBox box, float lo[3], float hi[3]) {
+   for (int a = 0; a < 3; a++) {
+      lo[a] = INFINITY;
+      hi[a] = -INFINITY;
+   }
+   for (int n = 0; n < 8; n++) {
+      Vector3 p(n & 1 ? box.max.x : box.min.x, n & 2 ? box.max.y : box.min.y, n & 4 ? box.max.z : box.min.z);
+      float c[3] = {Vector3::dot(p, u), Vector3::dot(p, v), Vector3::dot(p, w)};
+      for (int a = 0; a < 3; a++) {
+         lo[a] = std::min(lo[a], c[a]);
+         hi[a] = std::max(hi[a], c[a]);
+      }
+   }
+}
+
+void ShadowMap::rasterize(Surface* surface, int prim) {
+   float lo[3], hi[3];
+   project(surface->primitiveBounds(prim), lo, hi);
+
+   // the bounds go into every texel they overlap, padded against rounding
+   float pad = 0.01 * texel;
+   int i0 = std::max(0, (int) floor((lo[0] - pad - u0) / texel));
+   int i1 = std::min(nu - 1, (int) floor((hi[0] + pad - u0) / texel));
+   int j0 = std::max(0, (int) floor((lo[1] - pad - v0) / texel));
+   int j1 = std::min(nv - 1, (int) floor((hi[1] + pad - v0) / texel));
+   for (int j = j0; j <= j1; j++) {
+      for (int i = i0; i <= i1; i++) {
+         ShadowTexel& t = texels[j * nu + i];
+         if (hi[2] > t.top) {
+            t.second = t.top;
+            t.top = hi[2];
+            t.surface = surface;
+            t.prim = prim;
+         }
+         else if (hi[2] > t.second) {
+            t.second = hi[2];
+         }
+      }
+   }
+
+   // the primitive itself is only sampled at the corners, from above
+   i0 = std::max(0, (int) ceil((lo[0] - u0) / texel));
+   i1 = std::min(nu, (int) floor((hi[0] - u0) / texel));
+   j0 = std::max(0, (int) ceil((lo[1] - v0) / texel));
+   j1 = std::min(nv, (int) floor((hi[1] - v0) / texel));
+   unsigned p = prim;
+   HitRecord rec;
+   for (int j = j0; j <= j1; j++) {
+      for (int i = i0; i <= i1; i++) {
+         ShadowCorner& c = corners[j * (nu + 1) + i];
+         if (lo[2] <= c.floor) {
+            continue;
+         }
+         Vector3 origin = u * (u0 + i * texel) + v * (v0 + j * texel) + w * (hi[2] + 1.0f);
+         if (surface->hitPrimitives(&p, 1, Ray(origin, w * -1.0), 0.0, INFINITY, rec)) {
+            c.surface = surface;
+            c.prim = prim;
+            c.floor = lo[2];
+         }
+      }
+   }
+}
+
+int ShadowMap::lookup(const GBufferHit& hit, float t0, float tf) {
+   float pu = Vector3::dot(hit.pos, u) - u0;
+   float pv = Vector3::dot(hit.pos, v) - v0;
+   float pw = Vector3::dot(hit.pos, w);
+   int i = (int) floor(pu * invTexel), j = (int) floor(pv * invTexel);
+   if (nu == 0 || i < 0 || j < 0 || i >= nu || j >= nv) {
+      return 1;
+   }
+
+   // lit when every caster over the texel stays below the hit; the hit's own primitive
+   // may still shadow it through rounding, which one test settles
+   ShadowTexel& t = texels[j * nu + i];
+   if (t.top < pw) {
+      return 1;
+   }
+   Ray shadowRay(hit.pos, w);
+   HitRecord rec;
+   if (t.surface == hit.surface && t.prim == hit.index && t.second < pw) {
+      unsigned prim = hit.index;
+      RT_STAT(primitiveTests);
+      return hit.surface->hitPrimitives(&prim, 1, shadowRay, t0, tf, rec) ? 0 : 1;
+   }
+
+   // in shadow when one of the occluders found over the texel's corners blocks the ray
+   ShadowCorner* c = &corners[j * (nu + 1) + i];
+   ShadowCorner* candidates[4] = {c, c + 1, c + nu + 1, c + nu + 2};
+   for (int n = 0; n < 4; n++) {
+      Surface* surface = candidates[n]->surface;
+      unsigned prim = candidates[n]->prim;
+      bool tested = surface == NULL;
+      for (int m = 0; m < n && !tested; m++) {
+         tested = candidates[m]->surface == surface && candidates[m]->prim == prim;
+      }
+      if (!tested) {
+         RT_STAT(primitiveTests);
+         if (surface->hitPrimitives(&prim, 1, shadowRay, t0, tf, rec)) {
+            return 0;
+         }
+      }
+   }
+   return -1;
+}
+
+size_t ShadowMap::memoryBytes() {
+   return texels.capacity() * sizeof(ShadowTexel) + corners.capacity() * sizeof(ShadowCorner) +
+      (unbounded.capacity() + builtFrom.capacity()) * sizeof(Surface*) + casters.capacity() / 8;
+}
+
+//////////////////
+// Shadow Cache //
+//////////////////
+ShadowCache::ShadowCache() {
+   valid = false;
+   geometry = 0;
+}
+
+void ShadowCache::update(Scene& scene) {
+   // surfaces that cast no shadow, such as a sun, may move freely
+   std::vector<Surface*> castersIn;
+   for (int k = 0; k < scene.surfaces.size(); k++) {
+      if (scene.surfaces[k]->castsShadow) {
+         castersIn.push_back(scene.surfaces[k]);
+      }
+   }
+   unsigned long long geometryIn = geometryHash(castersIn);
+   valid = geometryIn == geometry && castersIn == casters;
+   if (valid) {
+      return;
+   }
+   geometry = geometryIn;
+   casters.swap(castersIn);
+   unbounded.clear();
+   surfaces.clear();
+   centers.clear();
+   radii.clear();
+   for (int k = 0; k < casters.size(); k++) {
+      BoundingBox box = casters[k]->bounds();
+      if (!box.bounded()) {
+         unbounded.push_back(casters[k]);
+         continue;
+      }
+      surfaces.push_back(casters[k]);
+      centers.push_back((box.min + box.max) * 0.5);
+      radii.push_back(box.extent().magnitude() * 0.5);
+   }
+}
+
+int ShadowCache::lookup(const GBufferHit& hit, Ray& shadowRay, float t0, float tf) {
+   if (!valid) {
+      return -1;
+   }
+   HitRecord rec;
+   if (hit.occluder != NULL) {
+      unsigned prim = hit.occluderPrim;
+      RT_STAT(primitiveTests);
+      return hit.occluder->hitPrimitives(&prim, 1, shadowRay, t0, tf, rec) ? 0 : -1;
+   }
+   if (hit.litCos > 1.0 || Vector3::dot(shadowRay.dir, hit.litDir) < hit.litCos) {
+      return -1;
+   }
+
+   // the cone leaves out the planes and the hit's own primitive, which are tested instead
+   if (hit.surface->castsShadow && hit.surface->bounds().bounded() && hit.surface->primitiveCount() == 1) {
+      RT_STAT(primitiveTests);
+      if (hit.surface->hit(shadowRay, t0, tf, rec)) {
+         return 0;
+      }
+   }
+   for (int k = 0; k < unbounded.size(); k++) {
+      RT_STAT(primitiveTests);
+      if (unbounded[k]->hit(shadowRay, t0, tf, rec)) {
+         return 0;
+      }
+   }
+   return 1;
+}
+
+void ShadowCache::store(GBufferHit& hit, Vector3 lightDir, const HitRecord& blocker) {
+   clear(hit);
+   if (blocker.surface != NULL) {
+      hit.occluder = blocker.surface;
+      hit.occluderPrim = blocker.index;
+      return;
+   }
+   if (surfaces.size() > MAX_CASTERS) {
+      return;
+   }
+
+   // the light may turn until the shadow ray grazes the bounding sphere of a caster
+   float clearance = M_PI;
+   for (int k = 0; k < surfaces.size(); k++) {
+      if (surfaces[k] == hit.surface && hit.surface->primitiveCount() == 1) {
+         continue;
+      }
+      Vector3 d = centers[k] - hit.pos;
+      float dist = d.magnitude();
+      if (dist <= radii[k]) {
+         return;
+      }
+      float angle = acos(std::max(-1.0f, std::min(1.0f, Vector3::dot(lightDir, d) / dist)));
+      clearance = std::min(clearance, angle - (float) asin(radii[k] / dist));
+   }
+   // with some room for rounding
+   clearance -= 0.001;
+   if (clearance > 0.0) {
+      hit.litDir = lightDir;
+      hit.litCos = cos(clearance);
+   }
+}
+
+void ShadowCache::clear(GBufferHit& hit) {
+   hit.occluder = NULL;
+   hit.occluderPrim = 0;
+   hit.litCos = 2.0;
+}
+
+///////////
+// Scene // 
+///////////
+Scene::Scene(float distToCamIn, Vector3 viewPoint, Vector3 up, Vector3 viewDir, 
+   float tIn, float bIn, float lIn, float rIn, int nxIn, int nyIn, DirectionalLight lightSourceIn) {
+   orthographic = true;
+   orthoCam = OrthographicCamera(viewPoint, up, viewDir, tIn, bIn, lIn, rIn, nxIn, nyIn);
+   perCam = PerspectiveCamera(distToCamIn, viewPoint + Vector3(0.0, -8.0, -40.0), up, viewDir, tIn, bIn, lIn, rIn, nxIn, nyIn);
+   if (orthographic) {
+      cam = &orthoCam;
+   }
+   else{
+      cam = &perCam;
+   }
+   lightSource = lightSourceIn;
+   accel = new SurfaceList();
+   startupMillis = -1.0;
+   frame = 0;
+   heatmap = NULL;
+   heatmapMode = HEATMAP_OFF;
+   tileSize = 32;
+   threads = std::max(1, (int) std::thread::hardware_concurrency());
+   simdWidth = SphereSet::MAX_SIMD_WIDTH;
+   settingsChecked = false;
+   cacheHits = false;
+   reproject = false;
+   cacheShadows = false;
+   mapShadows = false;
+   shadowMapSize = 1024;
+   shadowBudget = 4;
+   minAreaSamples = 4;
+   maxAreaSamples = 64;
+   areaSampleError = 0.01;
+   integrator = INTEGRATOR_WHITTED;
+   samplesPerPixel = 16;
+   maxBounces = 8;
+   adaptiveSampling = false;
+   minSamplesPerPixel = 8;
+   maxSamplesPerPixel = 256;
+   maxPixelError = 0.25;
+   pathTimeBudget = 0.0;
+   samplesPerSec = 0.0;
+   convergedFraction = 1.0;
+   antialias = false;
+   antialiasSamples = 8;
+   edgeNormalCosine = 0.9;
+   edgeColorStep = 24;
+   antialiasedFraction = 0.0;
+   tracedFraction = 1.0;
+   recordHits = false;
+   reuseHits = false;
+   reprojectHits = false;
+   framePeakResident = 0;
+   peakResident = 0;
+   peakResidentFrame = -1;
+   frameWidth = 0;
+   frameHeight = 0;
+   materials.push_back(Material());
+   createSurfaces();
+}
+
+Scene::~Scene() {
+   delete accel;
+}
+
+void Scene::setAccelerator(Accelerator* accelIn) {
+   delete accel;
+   accel = accelIn;
+}
+
+int Scene::addMaterial(Material materialIn) {
+   if (materials.size() > USHRT_MAX) {
+      // any id handed back would alias a material already in the table
+      std::cerr << "Scene::addMaterial: more than " << USHRT_MAX + 1 << " materials" << std::endl;
+      abort();
+   }
+   materials.push_back(materialIn);
+   return materials.size() - 1;
+}
+
+MemoryReport Scene::memoryReport() {
+   MemoryReport report;
+   report.bytes[MEM_PRIMITIVES] = surfaces.capacity() * sizeof(Surface*);
+   for (int k = 0; k < surfaces.size(); k++) {
+      report.bytes[MEM_PRIMITIVES] += surfaces[k]->memoryBytes();
+      report.primitives += surfaces[k]->primitiveCount();
+   }
+   report.bytes[MEM_MATERIALS] = materials.capacity() * sizeof(Material);
+   report.bytes[MEM_ACCELERATION] = accel->memoryBytes() + shadowMap.memoryBytes() + lightTree.memoryBytes();
+   report.bytes[MEM_FRAMEBUFFERS] = (size_t) frameWidth * frameHeight * 3 * (heatmap != NULL ? 2 : 1) +
+      pixelCost.capacity() * sizeof(float) + gbuffer.memoryBytes() + reprojection.memoryBytes();
+   for (int k = 0; k < pathBuffers.size(); k++) {
+      report.bytes[MEM_FRAMEBUFFERS] += pathBuffers[k].capacity() * sizeof(float);
+   }
+   report.bytes[MEM_FRAMEBUFFERS] += pixelSamples.capacity() * sizeof(int) + primaryHits.capacity() * sizeof(PrimaryHit);
+   report.peakResident = peakResident;
+   report.peakFrame = peakResidentFrame;
+   return report;
+}
+
+void Scene::setHeatmap(unsigned char* heatmapIn, HeatmapMode modeIn) {
+   heatmap = modeIn == HEATMAP_OFF ? NULL : heatmapIn;
+   heatmapMode = heatmap == NULL ? HEATMAP_OFF : modeIn;
+#ifndef RT_STATS
+   if (heatmapMode == HEATMAP_TESTS) {
+      std::cout << "Intersection test counts need -DRT_STATS, showing cycles instead." << std::endl;
+      heatmapMode = HEATMAP_CYCLES;
+   }
+#endif
+}
+
+void Scene::createSurfaces() {
+   // create materials
+   float surfaceIntensity = 0.4;
+   float specularIntensity = 0.4;
+   float ambientIntensity = 0.2;
+   float phongExp = 100.0;
+   Color red(255, 0, 0), green(0, 255, 0), blue(0, 0, 255), white(255, 255, 255), black(0, 0, 0);
+   Material sphere1Mat(red, white, red, surfaceIntensity, specularIntensity, ambientIntensity, phongExp);
+   Material sphere2Mat(green, white, green, surfaceIntensity, specularIntensity, ambientIntensity, phongExp); 
+   Material tetraMat(blue, white, blue, surfaceIntensity, specularIntensity, ambientIntensity, phongExp);
+   Material planeMat(white, white, white, surfaceIntensity, specularIntensity, ambientIntensity, phongExp);
+   planeMat.glazed = true;
+   int sphere1Id = addMaterial(sphere1Mat), sphere2Id = addMaterial(sphere2Mat);
+   int tetraId = addMaterial(tetraMat), planeId = addMaterial(planeMat);
+
+   // create spheres
+   float radius1 = 3.0, radius2 = 1.0;
+   Vector3 center1(0.0, radius1, -7.0), center2(2.0, radius2, 0.0);
+   Sphere* sphere1 = new Sphere(radius1, center1, sphere1Id);
+   Sphere* sphere2 = new Sphere(radius2, center2, sphere2Id);
+
+   // make tetrahedron
+   Vector3 t1(-9.0, 0.0, -3.0), t2(-6.0, 0.0, 0.0), t3(-4.0, 0.0, -4.0), t4(-7.0, 5.0, -2.0);
+   Triangle* front = new Triangle(t1, t2, t4, tetraId);
+   Triangle* bottom = new Triangle(t1, t3, t2, tetraId);
+   Triangle* left = new Triangle(t4, t3, t1, tetraId);
+   Triangle* right = new Triangle(t3, t4, t2, tetraId);
+
+   // make plane
+   Vector3 p1(0.0, 0.0, 10.0), p2(5.0, 0.0, 10.0), p3(2.5, 0.0, -5.0);
+   Plane* plane = new Plane(p1, p2, p3, planeId);
+
+   // add each surface to surface list
+   surfaces.push_back(sphere1);
+   surfaces.push_back(sphere2);
+   surfaces.push_back(front);
+   surfaces.push_back(bottom);
+   surfaces.push_back(left);
+   surfaces.push_back(right);
+   surfaces.push_back(plane);
+}
+
+void Scene::beginFrame() {
+   // surfaces may have been added or moved since the last frame
+   {
+      TraceScope buildScope("accel build", frame);
+      RT_PERF_PHASE(PERF_BUILD);
+      accel->build(surfaces);
+   }
+   SphereSet::simdWidth = simdWidth;
+   lightDir = lightSource.dir.normalized();
+   lightTree.build(lights);
+   areaLights.clear();
+   for (int k = 0; k < surfaces.size(); k++) {
+      float emission = materials[surfaces[k]->materialId].emission;
+      Sphere* sphere = dynamic_cast<Sphere*>(surfaces[k]);
+      if (emission > 0.0 && sphere != NULL) {
+         areaLights.push_back(SphereLight(sphere, emission));
+      }
+   }
+   if (startupMillis < 0.0) {
+      startupMillis = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - programStart).count();
+   }
+}
+
+void Scene::render(unsigned char* image, int width, int height, float tmin, float tmax) {
+   TraceScope frameScope("render frame", frame);
+   if (!settingsChecked) {
+      settingsChecked = true;
+      loadSettings(width, height);
+   }
+   resetPeakResident();
+   frameWidth = width;
+   frameHeight = height;
+   beginFrame();
+   if (integrator == INTEGRATOR_PATH && adaptiveSampling) {
+      renderAdaptivePaths(image, width, height, tmin, tmax);
+   }
+   else if (integrator == INTEGRATOR_PATH) {
+      renderPaths(image, width, height, tmin, tmax);
+   }
+   else {
+      if (heatmap != NULL) {
+         pixelCost.assign(width * height, 0.0);
+      }
+      updateCaches(width, height, tmin, tmax);
+      renderTiles(image, width, height, tmin, tmax);
+      antialiasedFraction = 0.0;
+      if (antialias) {
+         TraceScope antialiasScope("antialias", frame);
+         antialiasEdges(image, width, height, tmin, tmax);
+      }
+      if (reproject) {
+         reprojection.finish(*this);
+      }
+      if (heatmap != NULL) {
+         writeHeatmap(width, height);
+      }
+   }
+#ifdef RT_STATS
+   frameStats = RenderStats::collect();
+   frameStats.print(stderr, frame);
+#endif
+#ifdef RT_PERF
+   framePerf = PerfCounters::collect();
+   framePerf.print(stderr, frame);
+#endif
+   framePeakResident = peakResidentBytes();
+   if (framePeakResident > peakResident) {
+      peakResident = framePeakResident;
+      peakResidentFrame = frame;
+   }
+   frame++;
+}
+
+void Scene::updateCaches(int width, int height, float tmin, float tmax) {
+   recordHits = cacheHits;
+   reuseHits = cacheHits && gbuffer.update(*this, width, height, tmin, tmax, tileSize);
+   reprojectHits = false;
+   unsigned long long geometry = reproject || mapShadows ? geometryHash(surfaces) : 0;
+   if (reproject) {
+      TraceScope reprojectScope("reproject", frame);
+      reprojectHits = reprojection.update(*this, geometry, width, height);
+   }
+   if (cacheHits && cacheShadows) {
+      shadowCache.update(*this);
+   }
+   if (mapShadows) {
+      TraceScope shadowScope("shadow map", frame);
+      RT_PERF_PHASE(PERF_BUILD);
+      shadowMap.update(*this, geometry, shadowMapSize);
+   }
+}
+
+void Scene::renderTiles(unsigned char* image, int width, int height, float tmin, float tmax) {
+   // workers pull tiles off a shared counter until none are left; pixels never overlap, so
+   // nothing else is shared while rendering
+   int tilesX = (width + tileSize - 1) / tileSize;
+   int tilesY = (height + tileSize - 1) / tileSize;
+   std::atomic<int> nextTile(0), traced(0);
+   if (antialias) {
+      primaryHits.resize(width * height);
+   }
+   auto work = [&]() {
+      for (int tile = nextTile++; tile < tilesX * tilesY; tile = nextTile++) {
+         int x0 = (tile % tilesX) * tileSize;
+         int y0 = (tile / tilesX) * tileSize;
+         traced += renderTile(image, width, tile, x0, y0, std::min(x0 + tileSize, width), std::min(y0 + tileSize, height), tmin, tmax);
+      }
+   };
+   std::vector<std::thread> workers;
+   for (int t = 1; t < std::min(threads, tilesX * tilesY); t++) {
+      workers.push_back(std::thread(work));
+   }
+   work();
+   for (int t = 0; t < workers.size(); t++) {
+      workers[t].join();
+   }
+   tracedFraction = traced / (float) (width * height);
+}
+
+int Scene::renderTile(unsigned char* image, int width, int tile, int x0, int y0, int x1, int y1, float tmin, float tmax) {
+   TraceScope tileScope("tile", tile);
+   // chains are rewritten in pixel order, so the previous ones are read from a copy
+   std::vector<GBufferHit> previous, hits;
+   if (recordHits) {
+      previous.swap(gbuffer.tiles[tile]);
+   }
+   std::vector<GBufferHit>* chains = recordHits ? &gbuffer.tiles[tile] : NULL;
+   size_t offset = 0;
+   int traced = 0;
+   for(int i = y0; i < y1; i++) {
+      for (int j = x0; j < x1; j++) {
+         RT_PERF_PHASE(PERF_PRIMARY);
+         int idx = (i * width + j) * 3;
+         unsigned long long before = 0;
+         if (heatmap != NULL) {
+            before = heatmapMode == HEATMAP_CYCLES ? costClock() : RenderStats::local().primitiveTests;
+         }
+         Ray viewRay = cam->viewRay(j, i);
+         Color idxColor;
+         bool reused = false;
+         unsigned char* length = NULL;
+         if (recordHits) {
+            length = &gbuffer.lengths[i * width + j];
+            GBufferHit* kept = previous.data() + offset;
+            offset += *length;
+            if (reuseHits && *length > 0 && !gbuffer.stale(kept, *length, viewRay.origin)) {
+               idxColor = shadeChain(kept, *length, tmin, tmax);
+               chains->insert(chains->end(), kept, kept + *length);
+               reused = true;
+               if (antialias) {
+                  PrimaryHit& primary = primaryHits[i * width + j];
+                  primary.surface = kept[0].surface;
+                  primary.index = kept[0].surface != NULL ? kept[0].index : -1;
+                  primary.normal = kept[0].normal;
+               }
+               if (reproject) {
+                  HitRecord rec(kept[0].t);
+                  rec.surface = kept[0].surface;
+                  rec.index = kept[0].index;
+                  rec.pos = kept[0].pos;
+                  reprojection.store(j, i, rec, -1);
+               }
+            }
+         }
+         if (!reused) {
+            hits.clear();
+            HitRecord rec;
+            bool found;
+            int lit = -1;
+            if (reprojectHits && reprojection.reuse(j, i, viewRay, tmin, tmax, rec, lit)) {
+               found = true;
+            }
+            else {
+               found = traceRay(viewRay, tmin, tmax, 0, NULL, rec);
+               traced++;
+            }
+            idxColor = hitColor(viewRay, rec, found, tmin, tmax, 0, NULL, recordHits ? &hits : NULL, reproject ? &lit : NULL);
+            if (antialias) {
+               PrimaryHit& primary = primaryHits[i * width + j];
+               primary.surface = found ? rec.surface : NULL;
+               primary.index = found ? rec.index : -1;
+               primary.normal = rec.normal;
+            }
+            if (reproject) {
+               reprojection.store(j, i, rec, lit);
+            }
+            if (recordHits) {
+               *length = hits.size() <= GBuffer::MAX_CHAIN ? hits.size() : 0;
+               chains->insert(chains->end(), hits.begin(), hits.begin() + *length);
+            }
+         }
+         if (heatmap != NULL) {
+            unsigned long long after = heatmapMode == HEATMAP_CYCLES ? costClock() : RenderStats::local().primitiveTests;
+            pixelCost[i * width + j] = after - before;
+         }
+         image[idx] = idxColor.red;
+         image[idx+1] = idxColor.green;
+         image[idx+2] = idxColor.blue;
+      }
+   }
+   return traced;
+}
+
+void Scene::antialiasEdges(unsigned char* image, int width, int height, float tmin, float tmax) {
+   // edges are all found against the first pass's colors before any pixel is refined; the
+   // refined pixels never overlap, so workers share nothing but the counter
+   std::vector<unsigned char> onEdge(width * height, 0);
+   for (int i = 0; i < height; i++) {
+      for (int j = 0; j < width; j++) {
+         int p = i * width + j;
+         if (j + 1 < width && edgeBetween(image, p, p + 1)) {
+            onEdge[p] = onEdge[p + 1] = 1;
+         }
+         if (i + 1 < height && edgeBetween(image, p, p + width)) {
+            onEdge[p] = onEdge[p + width] = 1;
+         }
+      }
+   }
+   std::vector<int> edgePixels;
+   for (int p = 0; p < width * height; p++) {
+      if (onEdge[p]) {
+         edgePixels.push_back(p);
+      }
+   }
+   const int chunk = 64;
+   int chunks = (edgePixels.size() + chunk - 1) / chunk;
+   std::atomic<int> nextChunk(0);
+   auto work = [&]() {
+      for (int c = nextChunk++; c < chunks; c = nextChunk++) {
+         RT_PERF_PHASE(PERF_PRIMARY);
+         for (int k = c * chunk; k < std::min((c + 1) * chunk, (int) edgePixels.size()); k++) {
+            int p = edgePixels[k];
+            unsigned long long before = 0;
+            if (heatmap != NULL) {
+               before = heatmapMode == HEATMAP_CYCLES ? costClock() : RenderStats::local().primitiveTests;
+            }
+            // the center ray already in the image counts as one of the samples
+            int sum[3] = {image[p * 3], image[p * 3 + 1], image[p * 3 + 2]};
+            for (int s = 0; s < antialiasSamples; s++) {
+               float u, v;
+               sampler.get2D(p, s, 0, u, v);
+               Color c = rayColor(cam->subpixelRay(p % width + u, p / width + v), tmin, tmax);
+               sum[0] += c.red;
+               sum[1] += c.green;
+               sum[2] += c.blue;
+            }
+            int n = antialiasSamples + 1;
+            for (int ch = 0; ch < 3; ch++) {
+               image[p * 3 + ch] = (unsigned char) ((sum[ch] + n / 2) / n);
+            }
+            if (heatmap != NULL) {
+               unsigned long long after = heatmapMode == HEATMAP_CYCLES ? costClock() : RenderStats::local().primitiveTests;
+               pixelCost[p] += after - before;
+            }
+         }
+      }
+   };
+   std::vector<std::thread> workers;
+   for (int t = 1; t < std::min(threads, chunks); t++) {
+      workers.push_back(std::thread(work));
+   }
+   work();
+   for (int t = 0; t < workers.size(); t++) {
+      workers[t].join();
+   }
+   antialiasedFraction = edgePixels.size() / (float) (width * height);
+}
+
+bool Scene::edgeBetween(const unsigned char* image, int p, int q) {
+   PrimaryHit& a = primaryHits[p];
+   PrimaryHit& b = primaryHits[q];
+   if (a.surface != b.surface || a.index != b.index) {
+      return true;
+   }
+   if (a.surface != NULL && Vector3::dot(a.normal, b.normal) < edgeNormalCosine) {
+      return true;
+   }
+   for (int ch = 0; ch < 3; ch++) {
+      if (abs(image[p * 3 + ch] - image[q * 3 + ch]) > edgeColorStep) {
+         return true;
+      }
+   }
+   return false;
+}
+
+void Scene::writeHeatmap(int width, int height) {
+   // scale to the 99th percentile so a handful of outliers do not flatten the image
+   std::vector<float> sorted(pixelCost);
+   int rank = std::min((int) sorted.size() - 1, (int) (sorted.size() * 0.99));
+   std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+   float scale = sorted[rank] > 0.0 ? sorted[rank] : 1.0;
+   for (int k = 0; k < width * height; k++) {
+      Color c = falseColor(pixelCost[k] / scale);
+      heatmap[k * 3] = c.red;
+      heatmap[k * 3 + 1] = c.green;
+      heatmap[k * 3 + 2] = c.blue;
+   }
+}
+
+RenderSettings Scene::autotune(unsigned char* image, int width, int height, float tmin, float tmax) {
+   TraceScope tuneScope("autotune", frame);
+   settingsChecked = true;
+   unsigned char* savedHeatmap = heatmap;
+   heatmap = NULL;
+   // the sweep's frames are not part of the sequence, so they neither reuse nor hand on
+   // hits; the shadow map is built as render() would, so the sweep times the same shadow work
+   bool savedReproject = reproject, savedCacheHits = cacheHits;
+   reproject = false;
+   cacheHits = false;
+   beginFrame();
+   updateCaches(width, height, tmin, tmax);
+
+   // one knob at a time, each starting from the best of the ones before; every setting gets
+   // two frames and keeps the faster, which hides most of the first-touch and turbo noise
+   std::vector<int> threadCounts, tileSizes, widths;
+   int hardwareThreads = std::max(1, (int) std::thread::hardware_concurrency());
+   for (int t = 1; t < hardwareThreads; t *= 2) {
+      threadCounts.push_back(t);
+   }
+   threadCounts.push_back(hardwareThreads);
+   for (int size = 8; size <= 128; size *= 2) {
+      tileSizes.push_back(size);
+   }
+   // the widths the sphere kernel has code paths for in this build
+   for (int w = 1; w <= SphereSet::MAX_SIMD_WIDTH; w = w == 1 ? 4 : w * 2) {
+      widths.push_back(w);
+   }
+   RenderSettings best;
+   best.threads = threads;
+   best.tileSize = tileSize;
+   best.simdWidth = simdWidth;
+   best.millis = -1.0;
+   for (int knob = 0; knob < 3; knob++) {
+      std::vector<int>& values = knob == 0 ? threadCounts : knob == 1 ? tileSizes : widths;
+      RenderSettings trial = best;
+      for (int k = 0; k < values.size(); k++) {
+         int& value = knob == 0 ? trial.threads : knob == 1 ? trial.tileSize : trial.simdWidth;
+         value = values[k];
+         threads = trial.threads;
+         tileSize = trial.tileSize;
+         SphereSet::simdWidth = trial.simdWidth;
+         trial.millis = -1.0;
+         for (int rep = 0; rep < 2; rep++) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            renderTiles(image, width, height, tmin, tmax);
+            double millis = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            trial.millis = trial.millis < 0.0 ? millis : std::min(trial.millis, millis);
+         }
+         if (best.millis < 0.0 || trial.millis < best.millis) {
+            best = trial;
+         }
+      }
+   }
+#ifdef RT_STATS
+   RenderStats::collect();
+#endif
+#ifdef RT_PERF
+   PerfCounters::collect();
+#endif
+
+   threads = best.threads;
+   tileSize = best.tileSize;
+   simdWidth = best.simdWidth;
+   SphereSet::simdWidth = simdWidth;
+   heatmap = savedHeatmap;
+   reproject = savedReproject;
+   cacheHits = savedCacheHits;
+   std::cout << "Tuned render settings: " << threads << " threads, " << tileSize << " pixel tiles, sphere width "
+      << simdWidth << " (" << best.millis << " ms per frame)" << std::endl;
+   if (!tuningDir.empty()) {
+      saveSettings(width, height, best);
+   }
+   return best;
+}
+
+std::string Scene::tuningKey(int width, int height) {
+   char key[64];
+   snprintf(key, sizeof(key), "\t%016llx\t%dx%d", geometryHash(surfaces), width, height);
+   return cpuModel() + key;
+}
+
+bool Scene::loadSettings(int width, int height) {
+   if (tuningDir.empty()) {
+      return false;
+   }
+   FILE* f = fopen((tuningDir + "/render_settings.txt").c_str(), "r");
+   if (f == NULL) {
+      return false;
+   }
+   // one line per machine and scene: cpu model, scene hash, image size, then the settings
+   std::string key = tuningKey(width, height) + "\t";
+   char line[512];
+   bool found = false;
+   while (!found && fgets(line, sizeof(line), f) != NULL) {
+      RenderSettings loaded;
+      if (strncmp(line, key.c_str(), key.size()) == 0 &&
+            sscanf(line + key.size(), "%d %d %d", &loaded.threads, &loaded.tileSize, &loaded.simdWidth) == 3 &&
+            loaded.threads > 0 && loaded.tileSize > 0 && loaded.simdWidth > 0) {
+         threads = loaded.threads;
+         tileSize = loaded.tileSize;
+         simdWidth = std::min(loaded.simdWidth, (int) SphereSet::MAX_SIMD_WIDTH);
+         found = true;
+      }
+   }
+   fclose(f);
+   if (found) {
+      std::cout << "Loaded render settings: " << threads << " threads, " << tileSize << " pixel tiles, sphere width "
+         << simdWidth << std::endl;
+   }
+   return found;
+}
+
+void Scene::saveSettings(int width, int height, RenderSettings settings) {
+   std::string path = tuningDir + "/render_settings.txt";
+   std::string key = tuningKey(width, height) + "\t";
+   std::vector<std::string> lines;
+   FILE* f = fopen(path.c_str(), "r");
+   if (f != NULL) {
+      char line[512];
+      while (fgets(line, sizeof(line), f) != NULL) {
+         if (strncmp(line, key.c_str(), key.size()) != 0) {
+            lines.push_back(line);
+         }
+      }
+      fclose(f);
+   }
+   char entry[64];
+   snprintf(entry, sizeof(entry), "%d %d %d\n", settings.threads, settings.tileSize, settings.simdWidth);
+   lines.push_back(key + entry);
+
+   // same write-then-rename as the grid cache, so a concurrent reader sees the old or the new file
+   mkdir(tuningDir.c_str(), 0755);
+   std::string tmpPath = path + "." + std::to_string(getpid()) + ".tmp";
+   f = fopen(tmpPath.c_str(), "w");
+   if (f == NULL) {
+      std::cout << "Could not save render settings to " << path << std::endl;
+      return;
+   }
+   bool ok = true;
+   for (int k = 0; k < lines.size(); k++) {
+      ok = ok && fputs(lines[k].c_str(), f) >= 0;
+   }
+   ok = fclose(f) == 0 && ok;
+   if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) {
+      remove(tmpPath.c_str());
+      std::cout << "Could not save render settings to " << path << std::endl;
+   }
+}
+
+void Scene::switchCamera() {
+   if (orthographic) {
+      cam = &perCam;
+      std::cout << "Switching to perspective camera." << std::endl;
+   }
+   else {
+      cam = &orthoCam;
+      std::cout << "Switching to orthographic camera." << std::endl;
+   }
+   orthographic = !orthographic;
+}
+
+Color Scene::probePixel(int x, int y, float tmin, float tmax, PixelProbe& probe) {
+   beginFrame();
+   probe.x = x;
+   probe.y = y;
+   probe.events.clear();
+   probe.color = rayColor(cam->viewRay(x, y), tmin, tmax, 0, &probe);
+   return probe.color;
+}
+
+Color Scene::rayColor(Ray r, float t0, float tf, int depth, PixelProbe* probe, std::vector<GBufferHit>* hits) {
+   HitRecord rec;
+   bool found = traceRay(r, t0, tf, depth, probe, rec);
+   return hitColor(r, rec, found, t0, tf, depth, probe, hits, NULL);
+}
+
+bool Scene::traceRay(Ray r, float t0, float tf, int depth, PixelProbe* probe, HitRecord& rec) {
+   RT_STAT_DEPTH(depth);
+   if (depth == 0) {
+      RT_STAT(primaryRays);
+   }
+   else {
+      RT_STAT(reflectionRays);
+   }
+   if (probe != NULL) {
+      probe->addRay(depth, r);
+   }
+   if (!accel->hit(r, t0, tf, rec)) {
+      if (probe != NULL) {
+         probe->addMiss(depth);
+      }
+      return false;
+   }
+   if (probe != NULL) {
+      int index = std::find(surfaces.begin(), surfaces.end(), rec.surface) - surfaces.begin();
+      probe->addHit(depth, rec, index < surfaces.size() ? index : -1);
+   }
+   return true;
+}
+
+Color Scene::hitColor(Ray r, HitRecord& rec, bool found, float t0, float tf, int depth, PixelProbe* probe,
+   std::vector<GBufferHit>* hits, int* lit) {
+   if (!found) {
+      if (hits != NULL) {
+         GBufferHit miss;
+         miss.dir = r.dir;
+         miss.t = tf;
+         miss.surface = NULL;
+         ShadowCache::clear(miss);
+         hits->push_back(miss);
+      }
+      return Color(0, 0, 0);
+   }
+   GBufferHit hit;
+   hit.dir = r.dir;
+   hit.t = rec.t;
+   hit.surface = rec.surface;
+   hit.index = rec.index;
+   hit.pos = rec.pos;
+   hit.normal = rec.normal;
+   hit.materialId = rec.materialId;
+   ShadowCache::clear(hit);
+
+   Material& mat = materials[rec.materialId];
+   Color c = shadeHit(hit, t0, tf, depth, probe, lit);
+   if (hits != NULL) {
+      hits->push_back(hit);
+   }
+
+   if (mat.glazed) {
+      Ray mr(rec.pos, r.dir - rec.normal * 2 * Vector3::dot(r.dir, rec.normal));
+      Color traced;
+      {
+         RT_PERF_PHASE(PERF_REFLECTION);
+         traced = rayColor(mr, t0, tf, depth + 1, probe, hits);
+      }
+      Color reflectedColor = mat.specularColor / 255.0f * traced * mat.specularIntensity;
+      if (probe != NULL) {
+         probe->addShade(depth, c, reflectedColor, c + reflectedColor);
+      }
+      return c + reflectedColor;
+   }
+
+   if (probe != NULL) {
+      probe->addShade(depth, c, Color(0, 0, 0), c);
+   }
+   return c;
+}
+
+Color Scene::shadeHit(GBufferHit& hit, float t0, float tf, int depth, PixelProbe* probe, int* lit) {
+   // add ambient shading
+   Material& mat = materials[hit.materialId];
+   Color c = mat.ambientColor * mat.ambientIntensity;
+
+   // see if object is in shadow of another object (surfaces such as a sun can opt out); a
+   // light turned off entirely, e.g. in favour of an emissive sphere, costs no shadow ray
+   bool unblocked = false;
+   bool keyLight = lightSource.intensity > 0.0;
+   if (keyLight && lit != NULL && *lit >= 0) {
+      unblocked = *lit;
+   }
+   else if (keyLight) {
+      Ray shadowRay(hit.pos, lightDir);
+      // only hits kept in the G-buffer carry a cached shadow
+      bool cached = cacheShadows && recordHits;
+      int known = cached ? shadowCache.lookup(hit, shadowRay, t0, tf) : -1;
+      if (known < 0 && mapShadows) {
+         known = shadowMap.lookup(hit, t0, tf);
+         // planes are not in the map, but are cheap to test
+         HitRecord rec;
+         for (int k = 0; k < shadowMap.unbounded.size() && known == 1; k++) {
+            RT_STAT(primitiveTests);
+            known = !shadowMap.unbounded[k]->hit(shadowRay, t0, tf, rec);
+         }
+         if (known >= 0 && cached) {
+            ShadowCache::clear(hit);
+         }
+      }
+      if (known >= 0) {
+         RT_STAT(shadowLookups);
+         unblocked = known;
+      }
+      else {
+         RT_STAT(shadowRays);
+         RT_PERF_PHASE(PERF_SHADOW);
+         HitRecord blocker;
+         unblocked = !accel->occluded(shadowRay, t0, tf, cached ? &blocker : NULL);
+         if (cached) {
+            shadowCache.store(hit, lightDir, blocker);
+         }
+      }
+      if (probe != NULL) {
+         probe->addShadow(depth, shadowRay, !unblocked);
+      }
+      if (lit != NULL) {
+         *lit = unblocked;
+      }
+   }
+
+   // if an object is not in a shadow, add specular and diffuse shading
+   if (unblocked) {
+      Vector3 h = (hit.dir * -1.0 + lightDir).normalized();
+      float d = mat.surfaceIntensity * lightSource.intensity 
+         * std::max(0.0f, Vector3::dot(hit.normal, lightDir));
+      float s = mat.specularIntensity * lightSource.intensity 
+         * pow(std::max(0.0f, Vector3::dot(hit.normal, h)), mat.phongExp);
+      c = c + mat.surfaceColor * d + mat.surfaceColor * s;
+   }
+   if (!lights.empty()) {
+      c = c + shadeLights(hit, t0, tf, depth, probe);
+   }
+   if (!areaLights.empty()) {
+      c = c + shadeAreaLights(hit, t0, tf, depth, probe);
+   }
+   if (mat.emission > 0.0) {
+      c = c + mat.surfaceColor * mat.emission;
+   }
+   return c;
+}
+
+// a light reaching a hit, and what it adds there unless something blocks it
+class LightSample {
+   public:
+      Vector3 dir;
+      float dist;
+      float diffuse, specular;
+};
+
+Color Scene::shadeLights(GBufferHit& hit, float t0, float tf, int depth, PixelProbe* probe) {
+   // reused by every hit the thread shades
+   static thread_local std::vector<Light*> reaching;
+   static thread_local std::vector<LightSample> samples;
+   static thread_local std::vector<float> cumulative;
+   reaching.clear();
+   samples.clear();
+   lightTree.query(hit.pos, reaching);
+   RT_STAT_ADD(lightsReached, reaching.size());
+
+   Material& mat = materials[hit.materialId];
+   float total = 0.0;
+   for (int k = 0; k < reaching.size(); k++) {
+      LightSample sample;
+      float arriving;
+      if (!reaching[k]->illuminate(hit.pos, sample.dir, sample.dist, arriving)) {
+         continue;
+      }
+      float cosine = Vector3::dot(hit.normal, sample.dir);
+      if (cosine <= 0.0) {
+         continue;
+      }
+      Vector3 h = (hit.dir * -1.0 + sample.dir).normalized();
+      sample.diffuse = mat.surfaceIntensity * arriving * cosine;
+      sample.specular = mat.specularIntensity * arriving * pow(std::max(0.0f, Vector3::dot(hit.normal, h)), mat.phongExp);
+      if (sample.diffuse + sample.specular > 0.0) {
+         samples.push_back(sample);
+         total += sample.diffuse + sample.specular;
+      }
+   }
+   if (samples.empty()) {
+      return Color(0, 0, 0);
+   }
+
+   float diffuse = 0.0, specular = 0.0;
+   // lights [0, exact) get a ray each, the others share the rays left over
+   int budget = std::max(1, shadowBudget);
+   int exact = samples.size();
+   if (exact > budget) {
+      std::sort(samples.begin(), samples.end(), [](const LightSample& a, const LightSample& b) {
+         return a.diffuse + a.specular > b.diffuse + b.specular;
+      });
+      // a light earns its own ray when sampling by weight would pick it at least once anyway
+      exact = 0;
+      float rest = total;
+      while (exact < budget - 1 && (samples[exact].diffuse + samples[exact].specular) * (budget - exact) >= rest) {
+         rest -= samples[exact].diffuse + samples[exact].specular;
+         exact++;
+      }
+   }
+   auto blocked = [&](LightSample& sample) {
+      Ray shadowRay(hit.pos, sample.dir);
+      RT_STAT(shadowRays);
+      RT_PERF_PHASE(PERF_SHADOW);
+      bool occluded = accel->occluded(shadowRay, t0, std::min(tf, sample.dist));
+      if (probe != NULL) {
+         probe->addShadow(depth, shadowRay, occluded);
+      }
+      return occluded;
+   };
+   for (int k = 0; k < exact; k++) {
+      if (!blocked(samples[k])) {
+         diffuse += samples[k].diffuse;
+         specular += samples[k].specular;
+      }
+   }
+   if (exact < samples.size()) {
+      // the remaining rays pick lights in proportion to weight; a light that gets through
+      // counts (rest / weight) / rays times, so on average the sum is that of all of them
+      cumulative.clear();
+      float rest = 0.0;
+      for (int k = exact; k < samples.size(); k++) {
+         rest += samples[k].diffuse + samples[k].specular;
+         cumulative.push_back(rest);
+      }
+      int rays = budget - exact;
+      int key = hitSeed(hit.pos, depth);
+      for (int r = 0; r < rays; r++) {
+         float pick = sampler.get1D(key, r, 0) * rest;
+         int k = exact + (std::upper_bound(cumulative.begin(), cumulative.end(), pick) - cumulative.begin());
+         LightSample& sample = samples[std::min(k, (int) samples.size() - 1)];
+         if (!blocked(sample)) {
+            float weight = rest / ((sample.diffuse + sample.specular) * rays);
+            diffuse += sample.diffuse * weight;
+            specular += sample.specular * weight;
+         }
+      }
+   }
+   return mat.surfaceColor * diffuse + mat.surfaceColor * specular;
+}
+
+Color Scene::shadeAreaLights(GBufferHit& hit, float t0, float tf, int depth, PixelProbe* probe) {
+   Material& mat = materials[hit.materialId];
+   float diffuse = 0.0, specular = 0.0;
+   int key = hitSeed(hit.pos, depth);
+   for (int k = 0; k < areaLights.size(); k++) {
+      SphereLight& light = areaLights[k];
+      float lightDiffuse = 0.0, lightSpecular = 0.0, squares = 0.0;
+      int n = 0;
+      int limit = std::max(1, minAreaSamples);
+      while (n < limit) {
+         // the sampler's points stay evenly spread however many of them end up being used
+         float u1, u2;
+         sampler.get2D(key, n, 2 * k, u1, u2);
+         Vector3 dir;
+         float dist;
+         if (!light.sample(hit.pos, u1, u2, dir, dist)) {
+            break;
+         }
+         n++;
+         float cosine = Vector3::dot(hit.normal, dir);
+         if (cosine > 0.0) {
+            Ray shadowRay(hit.pos, dir);
+            RT_STAT(shadowRays);
+            RT_PERF_PHASE(PERF_SHADOW);
+            bool blocked = accel->occluded(shadowRay, t0, std::min(tf, dist));
+            if (probe != NULL) {
+               probe->addShadow(depth, shadowRay, blocked);
+            }
+            if (!blocked) {
+               Vector3 h = (hit.dir * -1.0 + dir).normalized();
+               float d = mat.surfaceIntensity * light.intensity * cosine;
+               float sp = mat.specularIntensity * light.intensity * pow(std::max(0.0f, Vector3::dot(hit.normal, h)), mat.phongExp);
+               lightDiffuse += d;
+               lightSpecular += sp;
+               squares += (d + sp) * (d + sp);
+            }
+         }
+         if (n == limit && limit < maxAreaSamples) {
+            // penumbrae and highlights: refine while the average is still uncertain
+            float mean = (lightDiffuse + lightSpecular) / n;
+            float variance = std::max(0.0f, squares / n - mean * mean);
+            if (sqrt(variance / n) > areaSampleError * light.intensity) {
+               limit = std::min(2 * limit, maxAreaSamples);
+            }
+         }
+      }
+      if (n > 0) {
+         diffuse += lightDiffuse / n;
+         specular += lightSpecular / n;
+      }
+   }
+   return mat.surfaceColor * diffuse + mat.surfaceColor * specular;
+}
+
+Color Scene::shadeChain(GBufferHit* hits, int count, float t0, float tf) {
+   // the same sums as rayColor, with the hits taken from the G-buffer
+   if (hits[0].surface == NULL) {
+      return Color(0, 0, 0);
+   }
+   Material& mat = materials[hits[0].materialId];
+   Color c = shadeHit(hits[0], t0, tf, 0, NULL, NULL);
+   if (mat.glazed && count > 1) {
+      Color traced = shadeChain(hits + 1, count - 1, t0, tf);
+      return c + mat.specularColor / 255.0f * traced * mat.specularIntensity;
+   }
+   return c;
+}
+
+// float rgb of a Color, 1 for full brightness
+static Vector3 toRgb(Color c) {
+   return Vector3(c.red, c.green, c.blue) / 255.0f;
+}
+
+static Vector3 multiply(Vector3 a, Vector3 b) {
+   return Vector3(a.x * b.x, a.y * b.y, a.z * b.z);
+}
+
+static float luminance(Vector3 rgb) {
+   return 0.2126f * rgb.x + 0.7152f * rgb.y + 0.0722f * rgb.z;
+}
+
+void Scene::renderPaths(unsigned char* image, int width, int height, float tmin, float tmax) {
+   // work items are one sample of one tile; each thread adds into a float buffer of its own,
+   // so nothing is shared until the buffers are summed, a band of rows per thread
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+   int spp = std::max(1, samplesPerPixel);
+   int tilesX = (width + tileSize - 1) / tileSize;
+   int tilesY = (height + tileSize - 1) / tileSize;
+   int items = tilesX * tilesY * spp;
+   int workers = std::max(1, std::min(threads, items));
+   pathBuffers.resize(workers);
+   for (int k = 0; k < workers; k++) {
+      pathBuffers[k].assign(width * height * 3, 0.0f);
+   }
+   std::atomic<int> nextItem(0);
+   auto trace = [&](int worker) {
+      std::vector<float>& buffer = pathBuffers[worker];
+      for (int item = nextItem++; item < items; item = nextItem++) {
+         int tile = item / spp, sample = item % spp;
+         TraceScope tileScope("path tile", tile);
+         RT_PERF_PHASE(PERF_PRIMARY);
+         int x0 = (tile % tilesX) * tileSize;
+         int y0 = (tile / tilesX) * tileSize;
+         for (int i = y0; i < std::min(y0 + tileSize, height); i++) {
+            for (int j = x0; j < std::min(x0 + tileSize, width); j++) {
+               SampleSequence values(&sampler, i * width + j, sample);
+               float dx, dy;
+               values.next2D(dx, dy);
+               Vector3 radiance = pathRadiance(cam->subpixelRay(j + dx, i + dy), tmin, tmax, values);
+               int idx = (i * width + j) * 3;
+               buffer[idx] += radiance.x;
+               buffer[idx + 1] += radiance.y;
+               buffer[idx + 2] += radiance.z;
+            }
+         }
+      }
+   };
+   auto merge = [&](int worker) {
+      float scale = 255.0f / spp;
+      for (int i = worker; i < height; i += workers) {
+         for (int idx = i * width * 3; idx < (i + 1) * width * 3; idx++) {
+            float sum = 0.0;
+            for (int k = 0; k < workers; k++) {
+               sum += pathBuffers[k][idx];
+            }
+            image[idx] = (unsigned char) std::min(255.0f, sum * scale);
+         }
+      }
+   };
+   for (int phase = 0; phase < 2; phase++) {
+      std::vector<std::thread> pool;
+      for (int t = 1; t < workers; t++) {
+         pool.push_back(phase == 0 ? std::thread(trace, t) : std::thread(merge, t));
+      }
+      if (phase == 0) {
+         trace(0);
+      }
+      else {
+         merge(0);
+      }
+      for (int t = 0; t < pool.size(); t++) {
+         pool[t].join();
+      }
+   }
+   double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+   samplesPerSec = (double) width * height * spp / std::max(seconds, 1e-9);
+   tracedFraction = 1.0;
+}
+
+// standard error, in 8 bit steps, of the mean luminance of n samples whose rgb sums and
+// squared luminance sum are in sums
+static float pixelError(const float* sums, int n) {
+   if (n < 2) {
+      return 1e30f;
+   }
+   float mean = luminance(Vector3(sums[0], sums[1], sums[2])) / n;
+   float variance = std::max(0.0f, (sums[3] - n * mean * mean) / (n - 1));
+   return 255.0f * sqrt(variance / n);
+}
+
+void Scene::renderAdaptivePaths(unsigned char* image, int width, int height, float tmin, float tmax) {
+   // passes over the tiles that still hold noisy pixels; within a pass a tile belongs to one
+   // thread, so the per-pixel sums are shared without locks. A pixel's sample indices only
+   // depend on how many samples it already has, so without a time budget the image does not
+   // depend on scheduling
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+   int pixels = width * height;
+   // a power of two, so every doubling ends on a whole Sobol or PMJ prefix
+   int minSpp = 1;
+   while (minSpp < std::min(minSamplesPerPixel, samplesPerPixel)) {
+      minSpp *= 2;
+   }
+   int maxSpp = std::max(minSpp, maxSamplesPerPixel);
+   long long budget = (long long) std::max(minSpp, samplesPerPixel) * pixels;
+   int tilesX = (width + tileSize - 1) / tileSize;
+   int tilesY = (height + tileSize - 1) / tileSize;
+   int tiles = tilesX * tilesY;
+   pathBuffers.resize(1);
+   std::vector<float>& sums = pathBuffers[0];
+   sums.assign(pixels * 4, 0.0f);
+   pixelSamples.assign(pixels, 0);
+   // samples each pixel takes in the current pass
+   std::vector<int> batch(pixels, minSpp);
+   std::vector<int> scheduled;
+   for (int t = 0; t < tiles; t++) {
+      scheduled.push_back(t);
+   }
+   long long spent = (long long) minSpp * pixels;
+   std::atomic<int> nextItem(0);
+   std::atomic<bool> outOfTime(false);
+   int pass = 0;
+   auto trace = [&]() {
+      for (int item = nextItem++; item < scheduled.size(); item = nextItem++) {
+         // the first pass always completes so every pixel has a value
+         if (pass > 0 && pathTimeBudget > 0.0 &&
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() > pathTimeBudget) {
+            outOfTime = true;
+            break;
+         }
+         int tile = scheduled[item];
+         TraceScope tileScope("path tile", tile);
+         RT_PERF_PHASE(PERF_PRIMARY);
+         int x0 = (tile % tilesX) * tileSize;
+         int y0 = (tile / tilesX) * tileSize;
+         for (int i = y0; i < std::min(y0 + tileSize, height); i++) {
+            for (int j = x0; j < std::min(x0 + tileSize, width); j++) {
+               int p = i * width + j;
+               for (int sample = pixelSamples[p]; sample < pixelSamples[p] + batch[p]; sample++) {
+                  SampleSequence values(&sampler, p, sample);
+                  float dx, dy;
+                  values.next2D(dx, dy);
+                  Vector3 radiance = pathRadiance(cam->subpixelRay(j + dx, i + dy), tmin, tmax, values);
+                  float lum = luminance(radiance);
+                  sums[p * 4] += radiance.x;
+                  sums[p * 4 + 1] += radiance.y;
+                  sums[p * 4 + 2] += radiance.z;
+                  sums[p * 4 + 3] += lum * lum;
+               }
+               pixelSamples[p] += batch[p];
+            }
+         }
+      }
+   };
+   int converged = 0;
+   for (; !scheduled.empty(); pass++) {
+      nextItem = 0;
+      int workers = std::max(1, std::min(threads, (int) scheduled.size()));
+      std::vector<std::thread> pool;
+      for (int t = 1; t < workers; t++) {
+         pool.push_back(std::thread(trace));
+      }
+      trace();
+      for (int t = 0; t < pool.size(); t++) {
+         pool[t].join();
+      }
+
+      // pixels still above the error double their samples; the noisiest tiles get them
+      // first, and tiles that no longer fit the budget wait
+      std::vector<float> tileError(tiles, 0.0f);
+      std::vector<long long> tileCost(tiles, 0);
+      converged = 0;
+      for (int p = 0; p < pixels; p++) {
+         int n = pixelSamples[p];
+         float error = pixelError(&sums[p * 4], n);
+         batch[p] = 0;
+         if (error <= maxPixelError) {
+            converged++;
+         }
+         else if (n < maxSpp) {
+            int tile = (p / width / tileSize) * tilesX + (p % width) / tileSize;
+            batch[p] = std::min(n, maxSpp - n);
+            tileError[tile] += error;
+            tileCost[tile] += batch[p];
+         }
+      }
+      std::vector<int> order;
+      for (int t = 0; t < tiles; t++) {
+         if (tileCost[t] > 0) {
+            order.push_back(t);
+         }
+      }
+      std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return tileError[a] > tileError[b]; });
+      scheduled.clear();
+      for (int k = 0; k < order.size() && !outOfTime; k++) {
+         if (spent + tileCost[order[k]] <= budget) {
+            scheduled.push_back(order[k]);
+            spent += tileCost[order[k]];
+         }
+      }
+   }
+
+   long long samples = 0;
+   for (int p = 0; p < pixels; p++) {
+      int n = std::max(1, pixelSamples[p]);
+      for (int ch = 0; ch < 3; ch++) {
+         image[p * 3 + ch] = (unsigned char) std::min(255.0f, sums[p * 4 + ch] * 255.0f / n);
+      }
+      samples += pixelSamples[p];
+   }
+   double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+   samplesPerSec = samples / std::max(seconds, 1e-9);
+   convergedFraction = converged / (float) pixels;
+   tracedFraction = 1.0;
+}
+
+Vector3 Scene::pathRadiance(Ray r, float t0, float tf, SampleSequence& sample) {
+   Vector3 radiance(0.0, 0.0, 0.0), throughput(1.0, 1.0, 1.0);
+   // emitters met after a diffuse bounce were already counted by directLight at that bounce,
+   // if it samples them; other emissive surfaces are only found by bouncing into them
+   bool diffuseBounce = false;
+   for (int bounce = 0; ; bounce++) {
+      HitRecord rec;
+      if (!traceRay(r, t0, tf, bounce, NULL, rec)) {
+         break;
+      }
+      Material& mat = materials[rec.materialId];
+      if (mat.emission > 0.0 && (!diffuseBounce || !isAreaLight(rec.surface))) {
+         radiance = radiance + multiply(throughput, toRgb(mat.surfaceColor) * mat.emission);
+      }
+      if (bounce == maxBounces) {
+         break;
+      }
+      // shade the side the ray arrived on
+      Vector3 normal = Vector3::dot(rec.normal, r.dir) > 0.0 ? rec.normal * -1.0 : rec.normal;
+      Vector3 albedo = toRgb(mat.surfaceColor) * mat.surfaceIntensity;
+      radiance = radiance + multiply(throughput, directLight(rec, normal, r.dir, mat, t0, tf, sample));
+
+      // glazed materials also reflect like a mirror; pick one of the two in proportion to
+      // how much each passes on
+      Vector3 mirror = mat.glazed ? toRgb(mat.specularColor) * mat.specularIntensity : Vector3(0.0, 0.0, 0.0);
+      float mirrorWeight = luminance(mirror), diffuseWeight = luminance(albedo);
+      if (mirrorWeight + diffuseWeight <= 0.0) {
+         break;
+      }
+      float mirrorChance = mirrorWeight / (mirrorWeight + diffuseWeight);
+      float choice = sample.next();
+      float u1, u2;
+      sample.next2D(u1, u2);
+      if (choice < mirrorChance) {
+         r = Ray(rec.pos, r.dir - normal * 2 * Vector3::dot(r.dir, normal));
+         throughput = multiply(throughput, mirror / mirrorChance);
+         diffuseBounce = false;
+      }
+      else {
+         // cosine weighted around the normal, whose pdf cancels the Lambert cosine
+         float radius = sqrt(u1), phi = 2.0f * M_PI * u2;
+         Vector3 helper = fabs(normal.x) > 0.9f ? Vector3(0.0, 1.0, 0.0) : Vector3(1.0, 0.0, 0.0);
+         Vector3 u = Vector3::cross(helper, normal).normalized();
+         Vector3 v = Vector3::cross(normal, u);
+         Vector3 dir = u * (radius * cos(phi)) + v * (radius * sin(phi)) + normal * sqrt(std::max(0.0f, 1.0f - u1));
+         r = Ray(rec.pos, dir);
+         throughput = multiply(throughput, albedo / (1.0f - mirrorChance));
+         diffuseBounce = true;
+      }
+
+      // Russian roulette: dim paths end early, survivors are scaled up to make up for it
+      if (bounce >= 2) {
+         float survive = std::min(0.95f, std::max(throughput.x, std::max(throughput.y, throughput.z)));
+         if (sample.next() >= survive) {
+            break;
+         }
+         throughput = throughput / survive;
+      }
+   }
+   return radiance;
+}
+
+bool Scene::isAreaLight(Surface* surface) {
+   for (int k = 0; k < areaLights.size(); k++) {
+      if (areaLights[k].sphere == surface) {
+         return true;
+      }
+   }
+   return false;
+}
+
+Vector3 Scene::directLight(HitRecord& rec, Vector3 normal, Vector3 viewDir, Material& mat, float t0, float tf, SampleSequence& sample) {
+   // the same diffuse and specular terms as shadeHit, per unit of light arriving
+   Vector3 color = toRgb(mat.surfaceColor);
+   auto reflected = [&](Vector3 dir, float arriving) {
+      float cosine = std::max(0.0f, Vector3::dot(normal, dir));
+      Vector3 h = (viewDir * -1.0 + dir).normalized();
+      float specular = pow(std::max(0.0f, Vector3::dot(normal, h)), mat.phongExp);
+      return color * (arriving * (mat.surfaceIntensity * cosine + mat.specularIntensity * specular));
+   };
+   auto blocked = [&](Vector3 dir, float dist) {
+      RT_STAT(shadowRays);
+      RT_PERF_PHASE(PERF_SHADOW);
+      return accel->occluded(Ray(rec.pos, dir), t0, std::min(tf, dist));
+   };
+
+   Vector3 light(0.0, 0.0, 0.0);
+   if (lightSource.intensity > 0.0 && Vector3::dot(normal, lightDir) > 0.0 && !blocked(lightDir, tf)) {
+      light = light + reflected(lightDir, lightSource.intensity);
+   }
+
+   // one of the other lights, picked by how much it would add; the dimension is drawn
+   // either way so later ones line up from path to path
+   float pick = sample.next();
+   if (!lights.empty()) {
+      static thread_local std::vector<Light*> reaching;
+      static thread_local std::vector<float> cumulative;
+      reaching.clear();
+      cumulative.clear();
+      lightTree.query(rec.pos, reaching);
+      float total = 0.0;
+      for (int k = 0; k < reaching.size(); k++) {
+         Vector3 dir;
+         float dist, arriving;
+         if (reaching[k]->illuminate(rec.pos, dir, dist, arriving) && Vector3::dot(normal, dir) > 0.0) {
+            total += luminance(reflected(dir, arriving));
+         }
+         cumulative.push_back(total);
+      }
+      if (total > 0.0) {
+         int k = std::upper_bound(cumulative.begin(), cumulative.end(), pick * total) - cumulative.begin();
+         k = std::min(k, (int) reaching.size() - 1);
+         Vector3 dir;
+         float dist, arriving;
+         reaching[k]->illuminate(rec.pos, dir, dist, arriving);
+         float chance = (cumulative[k] - (k > 0 ? cumulative[k - 1] : 0.0f)) / total;
+         if (chance > 0.0 && !blocked(dir, dist)) {
+            light = light + reflected(dir, arriving) / chance;
+         }
+      }
+   }
+
+   // one direction across each emissive sphere
+   for (int k = 0; k < areaLights.size(); k++) {
+      Vector3 dir;
+      float dist;
+      float u1, u2;
+      sample.next2D(u1, u2);
+      if (areaLights[k].sample(rec.pos, u1, u2, dir, dist) && Vector3::dot(normal, dir) > 0.0 && !blocked(dir, dist)) {
+         light = light + reflected(dir, areaLights[k].intensity);
+      }
    }
-   return Color(0, 0, 0);
+   return light;
 }
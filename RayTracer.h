@@ -1,4 +1,12 @@
+#ifndef RAYTRACER_H
+#define RAYTRACER_H
+
 #include <vector>
+#include <string>
+#include <iosfwd>
+#include "Profiling.h"
+
+class Accelerator;
 
 class Vector3 {
    public:
@@ -27,6 +35,24 @@ class Ray {
       Vector3 val(float t);
 };
 
+class BoundingBox {
+   public:
+      Vector3 min, max;
+
+      BoundingBox();
+      BoundingBox(Vector3 minIn, Vector3 maxIn);
+
+      void expand(Vector3 p);
+      void expand(BoundingBox box);
+      bool empty();
+      bool bounded();
+      bool contains(Vector3 p);
+      Vector3 extent();
+      bool hit(Ray r, float t0, float tf, float& tEnter, float& tExit);
+
+      static BoundingBox infinite();
+};
+
 class Camera {
    public:
       Vector3 w, e, u, v;
@@ -34,10 +60,19 @@ class Camera {
       int nx, ny;
       
       virtual Ray viewRay(int nx, int ny) = 0;
+      // ray through the point (x, y) of the image in pixel units; viewRay(i, j) goes
+      // through (i + 0.5, j + 0.5)
+      virtual Ray subpixelRay(float x, float y) = 0;
       virtual void changeOrientation(Vector3 viewPoint, Vector3 up, Vector3 viewDir) = 0;
+      // appends everything viewRay depends on, so two views can be compared
+      virtual void parameters(std::vector<float>& data);
+      // the inverse of viewRay: the pixel coordinates pos lies on and its distance along that
+      // pixel's ray, false if it is behind the camera
+      virtual bool project(Vector3 pos, float& xi, float& yi, float& depth) = 0;
 
    protected:
       Vector3 pixelToPos(int xi, int yi);
+      Vector3 imageToPos(float x, float y);
 };
 
 class OrthographicCamera : public Camera {
@@ -46,7 +81,9 @@ class OrthographicCamera : public Camera {
       OrthographicCamera(Vector3 viewPoint, Vector3 up, Vector3 viewDir, 
          float tIn, float bIn, float lIn, float rIn, int nxIn, int nyIn);
       Ray viewRay(int xi, int yi);
+      Ray subpixelRay(float x, float y);
       void changeOrientation(Vector3 viewPoint, Vector3 up, Vector3 viewDir);
+      bool project(Vector3 pos, float& xi, float& yi, float& depth);
 };
 
 class PerspectiveCamera : public Camera {
@@ -57,13 +94,28 @@ class PerspectiveCamera : public Camera {
       PerspectiveCamera(float distToCamIn, Vector3 viewPoint, Vector3 up, Vector3 viewDir,
          float tIn, float bIn, float lIn, float rIn, int nxIn, int nyIn);
       Ray viewRay(int xi, int yi);
+      Ray subpixelRay(float x, float y);
       void changeOrientation(Vector3 viewPoint, Vector3 up, Vector3 viewDir);
+      void parameters(std::vector<float>& data);
+      bool project(Vector3 pos, float& xi, float& yi, float& depth);
 };
 
+class Surface;
+
 class HitRecord {
    public:
       float t;
       bool hit;
+      // which primitive of a multi-primitive surface was hit
+      int index;
+
+      // filled in once for the closest hit by Surface::completeHit
+      Surface* surface;
+      Vector3 pos;
+      Vector3 normal;
+      int materialId;
+      // barycentric coordinates of pos with respect to vertices b and c (triangles only)
+      float u, v;
 
       HitRecord();
       HitRecord(float tIn);
@@ -94,20 +146,41 @@ class Material {
       float ambientIntensity;
       float phongExp; 
       bool glazed;
+      // above 0 a Sphere of this material lights the scene as an area light, with this
+      // intensity arriving wherever it is fully visible; it also shows up that much brighter
+      float emission;
 
       Material();
       Material(Color surfaceColorIn, Color specularColorIn, Color ambientColorIn, 
          float surfaceIntensityIn, float specularIntensityIn, float ambientIntensityIn, float phongExpIn);
 };
 
+// surfaces only hold an index into Scene::materials so traversal never touches shading data
 class Surface {
    public:
-      Material material;
+      unsigned short materialId;
+      bool castsShadow;
       virtual bool hit(Ray r, float t0, float tf, HitRecord& rec) = 0;
       virtual Vector3 normal(Vector3 pos) = 0;
+      virtual BoundingBox bounds() = 0;
+      // appends the numbers that define the shape and its material ids, used to key cached
+      // acceleration structures and to find the surfaces that changed between frames
+      virtual void geometry(std::vector<float>& data) = 0;
+      // bytes owned by the surface, including any arrays it holds
+      virtual size_t memoryBytes() = 0;
+
+      // surfaces made of many primitives (e.g. SphereSet) expose them individually to
+      // acceleration structures; by default a surface is a single primitive
+      virtual int primitiveCount();
+      virtual BoundingBox primitiveBounds(int prim);
+      virtual bool hitPrimitives(const unsigned* prims, int count, Ray r, float t0, float tf, HitRecord& rec);
+
+      // fills in the shading fields of rec once it is known to be the closest hit
+      virtual void completeHit(Ray& r, HitRecord& rec);
 
       Surface();
-      Surface(Material materialIn);
+      Surface(int materialIdIn);
+      virtual ~Surface();
 };
 
 class Sphere : public Surface {
@@ -115,9 +188,13 @@ class Sphere : public Surface {
       float radius;
       Vector3 center;
 
-      Sphere(float radiusIn, Vector3 centerIn, Material materialIn);
+      Sphere(float radiusIn, Vector3 centerIn, int materialIdIn);
       bool hit(Ray r, float t0, float tf, HitRecord& rec);
       Vector3 normal(Vector3 pos);
+      BoundingBox bounds();
+      void geometry(std::vector<float>& data);
+      size_t memoryBytes();
+      void completeHit(Ray& r, HitRecord& rec);
 };
 
 class Triangle : public Surface {
@@ -127,9 +204,13 @@ class Triangle : public Surface {
       Vector3 c;
       Vector3 n;
 
-      Triangle(Vector3 aIn, Vector3 bIn, Vector3 cIn, Material materialIn);
+      Triangle(Vector3 aIn, Vector3 bIn, Vector3 cIn, int materialIdIn);
       bool hit(Ray r, float t0, float tf, HitRecord& rec);
       Vector3 normal(Vector3 pos);
+      BoundingBox bounds();
+      void geometry(std::vector<float>& data);
+      size_t memoryBytes();
+      void completeHit(Ray& r, HitRecord& rec);
 };
 
 class Plane : public Surface {
@@ -137,18 +218,427 @@ class Plane : public Surface {
       Vector3 a;
       Vector3 n;
 
-      Plane(Vector3 aIn, Vector3 b, Vector3 c, Material materialIn);
+      Plane(Vector3 aIn, Vector3 b, Vector3 c, int materialIdIn);
+      bool hit(Ray r, float t0, float tf, HitRecord& rec);
+      Vector3 normal(Vector3 pos);
+      BoundingBox bounds();
+      void geometry(std::vector<float>& data);
+      size_t memoryBytes();
+      void completeHit(Ray& r, HitRecord& rec);
+};
+
+// many spheres in structure-of-arrays form, intersected eight at a time when built with AVX
+// and four at a time with SSE2
+class SphereSet : public Surface {
+   public:
+#if defined(__AVX__)
+      static const int MAX_SIMD_WIDTH = 8;
+#elif defined(__SSE2__)
+      static const int MAX_SIMD_WIDTH = 4;
+#else
+      static const int MAX_SIMD_WIDTH = 1;
+#endif
+      // spheres tested per step by every set; only change it while nothing is rendering
+      static int simdWidth;
+
+      std::vector<float> centerX, centerY, centerZ, radius;
+      std::vector<unsigned short> materialIds;
+
+      SphereSet();
+      void add(Vector3 center, float radiusIn, int materialId);
+      int size();
+
       bool hit(Ray r, float t0, float tf, HitRecord& rec);
       Vector3 normal(Vector3 pos);
+      BoundingBox bounds();
+      void geometry(std::vector<float>& data);
+      size_t memoryBytes();
+
+      int primitiveCount();
+      BoundingBox primitiveBounds(int prim);
+      bool hitPrimitives(const unsigned* prims, int count, Ray r, float t0, float tf, HitRecord& rec);
+      void completeHit(Ray& r, HitRecord& rec);
+
+   private:
+      std::vector<unsigned> allIds;
 };
 
-class DirectionalLight {
+class Light {
    public:
       float intensity;
+
+      // direction from pos towards the light, how far along it the light is (INFINITY for
+      // lights without a position) and the intensity that arrives; false if none does
+      virtual bool illuminate(Vector3 pos, Vector3& dir, float& dist, float& arriving) = 0;
+      // region outside which the light adds nothing, BoundingBox::infinite() if it reaches everywhere
+      virtual BoundingBox bounds() = 0;
+      virtual ~Light();
+};
+
+class DirectionalLight : public Light {
+   public:
       Vector3 dir;
 
       DirectionalLight();
       DirectionalLight(float intensityIn, Vector3 dirIn);
+      bool illuminate(Vector3 pos, Vector3& dirOut, float& dist, float& arriving);
+      BoundingBox bounds();
+};
+
+// full intensity at the light, fading smoothly to nothing at range
+class PointLight : public Light {
+   public:
+      Vector3 position;
+      float range;
+
+      PointLight();
+      PointLight(float intensityIn, Vector3 positionIn, float rangeIn);
+      bool illuminate(Vector3 pos, Vector3& dir, float& dist, float& arriving);
+      BoundingBox bounds();
+};
+
+// a point light shining along dir: full intensity up to innerAngle off the axis, fading to
+// nothing at outerAngle (both in radians)
+class SpotLight : public PointLight {
+   public:
+      Vector3 dir;
+      float cosInner, cosOuter;
+
+      SpotLight(float intensityIn, Vector3 positionIn, float rangeIn, Vector3 dirIn, float innerAngle, float outerAngle);
+      bool illuminate(Vector3 pos, Vector3& dirOut, float& dist, float& arriving);
+};
+
+// an emissive Sphere seen as a light. Like a directional light it does not fade with
+// distance, but shadow rays aim at points across the sphere, which softens the shadows
+class SphereLight : public Light {
+   public:
+      Sphere* sphere;
+
+      SphereLight(Sphere* sphereIn, float intensityIn);
+      // towards the centre, as if the sphere were a point
+      bool illuminate(Vector3 pos, Vector3& dir, float& dist, float& arriving);
+      BoundingBox bounds();
+      // direction (u1, u2) in [0, 1)^2 of the cone the sphere covers as seen from pos, uniform
+      // in solid angle, and how far the sphere is along it; false if pos is inside the sphere
+      bool sample(Vector3 pos, float u1, float u2, Vector3& dir, float& dist);
+};
+
+// node of a LightTree; the left child of an inner node directly follows it
+class LightNode {
+   public:
+      BoundingBox box;
+      // a leaf's range of LightTree::bounded when count > 0, otherwise the right child
+      int first, count;
+};
+
+// bounding volume hierarchy over the bounds of the lights, so a hit only looks at the
+// lights that can reach it
+class LightTree {
+   public:
+      static const int LEAF_SIZE = 4;
+
+      // lights that reach everywhere, returned by every query
+      std::vector<Light*> unbounded;
+
+      void build(std::vector<Light*>& lights);
+      // appends every light whose bounds contain pos
+      void query(Vector3 pos, std::vector<Light*>& out);
+      size_t memoryBytes();
+
+   private:
+      std::vector<Light*> bounded;
+      std::vector<BoundingBox> boxes;
+      std::vector<LightNode> nodes;
+
+      int buildNode(std::vector<int>& order, int first, int count);
+};
+
+enum SamplerKind { SAMPLER_RANDOM, SAMPLER_SOBOL, SAMPLER_PMJ };
+
+// sample points in [0, 1) for Monte Carlo estimates, a value for every pixel, sample index and
+// dimension. The same arguments always give the same value, so results do not depend on
+// which thread asks. "pixel" can be any key that tells independent streams apart.
+// SAMPLER_SOBOL: the first two Sobol dimensions with hash-based Owen scrambling, scrambled
+// independently for every pair of dimensions. SAMPLER_PMJ: progressive multi-jittered
+// points from a few precomputed sets, picked and toroidally shifted per pixel and pair of
+// dimensions. With both, the first 2^k samples of a pixel stay well stratified, so they
+// suit progressive and adaptive sampling. SAMPLER_RANDOM: independent hashed values, as a
+// baseline
+class Sampler {
+   public:
+      // points per PMJ set; later indices move on to another set
+      static const int PMJ_POINTS = 4096;
+      static const int PMJ_SETS = 8;
+
+      SamplerKind kind;
+      // changes every value, e.g. to get a new noise pattern each frame
+      unsigned seed;
+
+      Sampler();
+      Sampler(SamplerKind kindIn, unsigned seedIn = 0);
+      float get1D(int pixel, int index, int dim);
+      // dimensions dim and dim + 1, stratified together
+      void get2D(int pixel, int index, int dim, float& u, float& v);
+};
+
+// the dimensions of one sample of one pixel, handed out in order
+class SampleSequence {
+   public:
+      SampleSequence(Sampler* samplerIn, int pixelIn, int indexIn);
+      float next();
+      // starts at an even dimension, so the pair shares a 2D stratification
+      void next2D(float& u, float& v);
+
+   private:
+      Sampler* sampler;
+      int pixel, index, dim;
+};
+
+enum ProbeEventType { PROBE_RAY, PROBE_HIT, PROBE_MISS, PROBE_SHADOW, PROBE_SHADE };
+
+// one step of tracing a probed pixel; which fields are set depends on the type
+class ProbeEvent {
+   public:
+      ProbeEventType type;
+      // recursion depth of Scene::rayColor, 0 for the primary ray
+      int depth;
+      // PROBE_RAY and PROBE_SHADOW: the ray that was traced
+      Vector3 origin, dir;
+      // PROBE_HIT: the completed closest hit and the index of its surface in Scene::surfaces
+      HitRecord hit;
+      int surfaceIndex;
+      // PROBE_SHADOW: whether something blocked the light
+      bool occluded;
+      // PROBE_SHADE: ambient plus direct light at this bounce, what the reflection added, the sum
+      Color local, reflected, result;
+};
+
+// everything Scene::probePixel saw while tracing one pixel
+class PixelProbe {
+   public:
+      int x, y;
+      Color color;
+      std::vector<ProbeEvent> events;
+
+      void addRay(int depth, Ray& r);
+      void addHit(int depth, HitRecord& rec, int surfaceIndex);
+      void addMiss(int depth);
+      void addShadow(int depth, Ray& r, bool occluded);
+      void addShade(int depth, Color local, Color reflected, Color result);
+      void print(std::ostream& out);
+};
+
+// what the optional second image of Scene::render shows per pixel
+enum HeatmapMode { HEATMAP_OFF, HEATMAP_CYCLES, HEATMAP_TESTS };
+
+// how Scene::render turns rays into colors: rayColor's Phong shading with mirror
+// reflections, or Monte Carlo path tracing with global illumination
+enum Integrator { INTEGRATOR_WHITTED, INTEGRATOR_PATH };
+
+// what a pixel's center ray hit, kept for finding edges after the first pass
+class PrimaryHit {
+   public:
+      // NULL for a miss
+      Surface* surface;
+      int index;
+      Vector3 normal;
+};
+
+// one ray of a pixel's primary and reflection chain, with what is needed to shade its hit again
+class GBufferHit {
+   public:
+      Vector3 dir;
+      // where the ray stopped: the hit, or tf for a miss
+      float t;
+      // NULL for a miss
+      Surface* surface;
+      int index;
+      Vector3 pos;
+      Vector3 normal;
+      int materialId;
+      // shadow cache (Scene::cacheShadows): the primitive that last blocked the light, or
+      // for a lit hit the light direction it was traced for and the cosine of the angle the
+      // light may turn away from it before anything could get in the way (above 1 if unknown)
+      Surface* occluder;
+      unsigned occluderPrim;
+      Vector3 litDir;
+      float litCos;
+};
+
+class Scene;
+
+// the shadow casters a ShadowCache entry is checked against, collected once per frame
+class ShadowCache {
+   public:
+      // with more bounded casters than this, lit hits are not cached
+      static const int MAX_CASTERS = 64;
+
+      // casters without bounds (planes), tested on every reuse
+      std::vector<Surface*> unbounded;
+      // false when a caster changed since the last frame, so no entry may be reused
+      bool valid;
+
+      ShadowCache();
+      void update(Scene& scene);
+      // cached outcome for hit under the light direction of shadowRay: 1 lit, 0 blocked, -1 if
+      // the cache cannot tell
+      int lookup(const GBufferHit& hit, Ray& shadowRay, float t0, float tf);
+      // remembers how a traced shadow ray from hit ended; blocker.surface is NULL if it was lit
+      void store(GBufferHit& hit, Vector3 lightDir, const HitRecord& blocker);
+      static void clear(GBufferHit& hit);
+
+   private:
+      unsigned long long geometry;
+      std::vector<Surface*> casters;
+      // bounding spheres of the bounded casters
+      std::vector<Surface*> surfaces;
+      std::vector<Vector3> centers;
+      std::vector<float> radii;
+};
+
+// hit chains of every pixel of the last frame. While the camera stays where it is, a pixel
+// only needs its shadows and shading redone, unless a surface that moved, appeared or
+// disappeared overlaps one of its rays before, or after, the change
+class GBuffer {
+   public:
+      // chains longer than this are not kept; those pixels are always traced
+      static const int MAX_CHAIN = 16;
+
+      // the chains of each tile, pixel after pixel, in the order renderTile visits them
+      std::vector<std::vector<GBufferHit> > tiles;
+      // rays kept for each pixel, 0 when the pixel has to be traced
+      std::vector<unsigned char> lengths;
+
+      GBuffer();
+      // compares the scene with the previous call and collects the surfaces that changed;
+      // false (with every chain dropped) when nothing can be reused
+      bool update(Scene& scene, int width, int height, float tmin, float tmax, int tileSize);
+      // whether a changed surface may now be hit by one of the rays of a chain
+      bool stale(const GBufferHit* hits, int count, Vector3 origin);
+      size_t memoryBytes();
+
+   private:
+      Camera* cam;
+      std::vector<float> view;
+      int width, height, tileSize;
+      float tmin, tmax;
+      std::vector<bool> glazed;
+      // geometry and bounds of every surface at the last call
+      std::vector<Surface*> surfaces;
+      std::vector<std::vector<float> > geometry;
+      std::vector<BoundingBox> bounds;
+      // surfaces that differ from the last call, with their old and new bounds
+      std::vector<Surface*> changedSurfaces;
+      std::vector<BoundingBox> changedBounds;
+};
+
+// primary hits of the last frame, reused from a camera that has moved a little. Every hit
+// is projected into the new view, giving a guess and a depth for the pixels it lands on
+// (the nearest one wins). A guess is only taken when the new ray hits that primitive at
+// that depth and no nearer surface was projected right next to it; everything else, and
+// a one pixel border, is traced. What came in from off screen needs no wider border: no
+// old hit lands on the band uncovered along the edge, so it has no guesses.
+class Reprojection {
+   public:
+      Reprojection();
+      // projects the last frame's hits into the current view of scene; false (no pixel
+      // can be reused) on the first frame, after a resize or when the geometry (the
+      // geometryHash of the scene's surfaces) changed
+      bool update(Scene& scene, unsigned long long geometry, int width, int height);
+      // the hit of ray r through pixel (x, y), when the guess for it holds up; lit is set to
+      // whether the light reached the hit in the last frame, or -1 if that is not known
+      bool reuse(int x, int y, Ray r, float t0, float tf, HitRecord& rec, int& lit);
+      // remembers what pixel (x, y) hit this frame and whether it was lit (-1 if not known);
+      // rec.surface is NULL for a miss
+      void store(int x, int y, const HitRecord& rec, int lit);
+      // makes this frame's hits the ones the next update() projects
+      void finish(Scene& scene);
+      size_t memoryBytes();
+
+   private:
+      // copies of the camera the stored hits were seen from, and the current camera
+      OrthographicCamera orthoCam;
+      PerspectiveCamera perCam;
+      Camera* cam;
+      Camera* curCam;
+      int width, height;
+      unsigned long long geometry;
+      // shadows carry over only while the light and the set of shadow casters stay put
+      Vector3 lightDir;
+      std::vector<bool> casters;
+      bool shadowsValid;
+      // per pixel: surface, primitive, position and shadow of the last frame's primary hit,
+      // and the projected guess with its depth in the current view
+      std::vector<Surface*> surfaces, nextSurfaces, guesses;
+      std::vector<unsigned> prims, nextPrims, guessPrims;
+      std::vector<Vector3> positions, nextPositions;
+      std::vector<signed char> shadows, nextShadows;
+      std::vector<float> guessDepths;
+
+      bool sameHit(int k, Surface* surface, unsigned prim);
+};
+
+// a ShadowMap texel: upper bounds on the height (along the light) of the two highest
+// casters whose bounds overlap it, and the primitive the first belongs to
+class ShadowTexel {
+   public:
+      float top, second;
+      Surface* surface;
+      unsigned prim;
+};
+
+// a ShadowMap texel corner: a primitive the line through the corner along the light meets,
+// the one whose lowest point is highest, and that height
+class ShadowCorner {
+   public:
+      Surface* surface;
+      unsigned prim;
+      float floor;
+};
+
+// depth map of the bounded shadow casters seen from a directional light, on a grid of
+// texels across the light direction. A hit is lit when no caster's bounds over its texel
+// reach above it, and in shadow when an occluder sampled at the texel's corners blocks its
+// shadow ray; anything else, mostly near edges, is left to a full shadow ray
+class ShadowMap {
+   public:
+      // casters without bounds (planes), which the map leaves out; test them directly
+      std::vector<Surface*> unbounded;
+
+      ShadowMap();
+      // rebuilds the map when the light, the casters, their geometryHash or the size changed
+      // since the last call
+      void update(Scene& scene, unsigned long long geometry, int size);
+      // 1 if no bounded caster blocks the light at the hit, 0 if one does, -1 if the map
+      // cannot tell
+      int lookup(const GBufferHit& hit, float t0, float tf);
+      size_t memoryBytes();
+
+   private:
+      // light space: w points towards the light, texel (0, 0) starts at (u0, v0)
+      Vector3 u, v, w;
+      float u0, v0, texel, invTexel;
+      int nu, nv;
+      int builtSize;
+      unsigned long long geometry;
+      std::vector<Surface*> builtFrom;
+      std::vector<bool> casters;
+      std::vector<ShadowTexel> texels;
+      std::vector<ShadowCorner> corners;
+
+      // lower and upper corner of box in light space
+      void project(BoundingBox box, float lo[3], float hi[3]);
+      void rasterize(Surface* surface, int prim);
+};
+
+// the knobs Scene::autotune() sweeps
+class RenderSettings {
+   public:
+      int threads;
+      int tileSize;
+      int simdWidth;
+      // best time of a frame rendered with these settings
+      double millis;
 };
 
 class Scene {
@@ -159,14 +649,184 @@ class Scene {
       PerspectiveCamera perCam;
       DirectionalLight lightSource;
       std::vector<Surface*> surfaces;
+      // shared by every surface; entry 0 is a default material
+      std::vector<Material> materials;
 
       Scene(float distToCamIn, Vector3 viewPoint, Vector3 up, Vector3 viewDir, 
          float tIn, float bIn, float lIn, float rIn, int nxIn, int nyIn, DirectionalLight lightSourceIn);
+      ~Scene();
 
       void render(unsigned char* image, int width, int height, float tmin, float tmax);
       void switchCamera();
+      // per-frame setup done by render(), needed before calling rayColor directly
+      void beginFrame();
+      // probe is only passed by probePixel; render() never logs anything. hits, when given,
+      // receives every ray of the chain for the G-buffer
+      Color rayColor(Ray r, float t0, float tf, int depth = 0, PixelProbe* probe = NULL, std::vector<GBufferHit>* hits = NULL);
+      // traces pixel (x, y) of the current camera through the same code as render() and
+      // records every ray, hit, shadow test and bounce contribution into probe
+      Color probePixel(int x, int y, float tmin, float tmax, PixelProbe& probe);
+      void setAccelerator(Accelerator* accelIn);
+      // returns the id of the new entry; aborts once the table already holds the 65536
+      // materials a surface's 16-bit materialId can refer to
+      int addMaterial(Material materialIn);
+      // bytes held by this scene by category; framebuffers are the images of the last render()
+      MemoryReport memoryReport();
+      // render() also writes a false-colored cost image of the same size into heatmapIn
+      void setHeatmap(unsigned char* heatmapIn, HeatmapMode modeIn);
+      // renders the current frame repeatedly while sweeping thread count, tile size and sphere
+      // kernel width, keeps the fastest and stores it in tuningDir when that is set
+      RenderSettings autotune(unsigned char* image, int width, int height, float tmin, float tmax);
+
+      // milliseconds from program start until the first frame's rays were ready to go
+      double startupMillis;
+      // counters of the last rendered frame, only filled in when compiled with -DRT_STATS
+      RenderStats frameStats;
+      // hardware counters of the last rendered frame, only filled in when compiled with -DRT_PERF
+      PerfCounters framePerf;
+      int frame;
+      // edge length in pixels of the square tiles render() works through
+      int tileSize;
+      // threads sharing the tiles of a frame, the calling thread included
+      int threads;
+      // SphereSet kernel width used while this scene renders
+      int simdWidth;
+      // directory of tuned settings keyed by CPU model, scene hash and image size; when set,
+      // the first render() picks up whatever autotune() stored there for this machine
+      std::string tuningDir;
+      // keep each pixel's hits and, while the camera does not move, only redo shadows and
+      // shading in later frames; for animations that change lights or a few surfaces
+      bool cacheHits;
+      // reuse primary hits, and the shadows at them, of the previous frame where the camera
+      // moved; approximate, geometry or shadow edges thinner than a pixel can be missed
+      bool reproject;
+      // with cacheHits, also keep each hit's shadow: the occluder, re-tested first, or for a lit
+      // hit how far the light may turn before it needs tracing again; for slowly moving lights
+      bool cacheShadows;
+      // lights besides lightSource, owned by the caller. The shadow map, the shadow cache and
+      // reprojection only ever cover lightSource
+      std::vector<Light*> lights;
+      // most shadow rays a hit spends on lights; where more lights reach it, the brightest get
+      // a ray each and the others share what is left at random, weighted by how much they add,
+      // which keeps their average right at the cost of noise
+      int shadowBudget;
+      // shadow rays per hit towards each emissive sphere: minAreaSamples, and where those
+      // disagree (penumbrae, highlights), twice as many at a time until the standard error of
+      // what the sphere adds falls below areaSampleError times its intensity, or
+      // maxAreaSamples are spent
+      int minAreaSamples, maxAreaSamples;
+      float areaSampleError;
+      // answer shadow queries from a ShadowMap of shadowMapSize texels along its longer side
+      // where it can, and trace shadow rays only near caster edges; same images either way
+      bool mapShadows;
+      int shadowMapSize;
+      // INTEGRATOR_PATH traces samplesPerPixel paths through every pixel per frame. It skips
+      // the G-buffer, reprojection, the shadow map and cache, and the heatmap
+      Integrator integrator;
+      int samplesPerPixel;
+      // where camera jitter, light and bounce choices of the path tracer, and the random
+      // choices of shadeHit's extra lights and area lights, come from
+      Sampler sampler;
+      // paths end after this many bounces; from the third bounce on, Russian roulette may end
+      // them sooner
+      int maxBounces;
+      // with adaptiveSampling, samplesPerPixel is the average the frame may spend instead:
+      // every pixel gets minSamplesPerPixel (rounded up to a power of two), then the pixels
+      // whose standard error is above maxPixelError (in 8 bit steps) double their samples,
+      // noisiest tiles first, until they converge, reach maxSamplesPerPixel, or the budget
+      // runs out. A pathTimeBudget above 0 also ends refinement after that many milliseconds,
+      // at the cost of images that depend on timing
+      bool adaptiveSampling;
+      int minSamplesPerPixel, maxSamplesPerPixel;
+      float maxPixelError;
+      double pathTimeBudget;
+      // path samples per second of the last frame rendered with INTEGRATOR_PATH
+      double samplesPerSec;
+      // with adaptiveSampling: samples each pixel got in the last frame, and the share of
+      // pixels that converged
+      std::vector<int> pixelSamples;
+      float convergedFraction;
+      // share of the last frame's pixels whose primary rays were traced rather than taken
+      // from the G-buffer or reprojected
+      float tracedFraction;
+      // resident set size high-water mark of the last frame, and the worst frame so far
+      size_t framePeakResident;
+      size_t peakResident;
+      int peakResidentFrame;
+      // with antialias, a Whitted frame traces antialiasSamples more rays through jittered
+      // points of every pixel that differs from a neighbour in the primitive hit, in normal
+      // (a cosine below edgeNormalCosine) or in color (a channel more than edgeColorStep
+      // apart), and averages them with its center ray
+      bool antialias;
+      int antialiasSamples;
+      float edgeNormalCosine;
+      int edgeColorStep;
+      // share of the last frame's pixels that got the extra rays
+      float antialiasedFraction;
+      // raw per-pixel cost of the last frame when a heatmap is requested
+      std::vector<float> pixelCost;
    
    private:
+      Accelerator* accel;
+      // lightSource.dir normalized once per frame
+      Vector3 lightDir;
+      unsigned char* heatmap;
+      HeatmapMode heatmapMode;
+      int frameWidth, frameHeight;
+      bool settingsChecked;
+      GBuffer gbuffer;
+      Reprojection reprojection;
+      ShadowMap shadowMap;
+      ShadowCache shadowCache;
+      LightTree lightTree;
+      // the spheres with an emissive material, collected by beginFrame
+      std::vector<SphereLight> areaLights;
+      // float rgb sums of each path tracing thread, added up into the image at the end of a
+      // frame; adaptive sampling keeps one buffer of rgb and squared luminance sums instead
+      std::vector<std::vector<float> > pathBuffers;
+      // center ray hits of the current frame when antialias is on
+      std::vector<PrimaryHit> primaryHits;
+      // what renderTile does with the G-buffer and the reprojected hits in the current frame
+      bool recordHits, reuseHits, reprojectHits;
+
       void createSurfaces();
-      Color rayColor(Ray r, float t0, float tf);
-};
\ No newline at end of file
+      // brings the G-buffer, reprojection, the shadow cache and the shadow map up to date
+      // for the coming Whitted frame and sets the flags above
+      void updateCaches(int width, int height, float tmin, float tmax);
+      void renderTiles(unsigned char* image, int width, int height, float tmin, float tmax);
+      // returns how many pixels were traced
+      int renderTile(unsigned char* image, int width, int tile, int x0, int y0, int x1, int y1, float tmin, float tmax);
+      void renderPaths(unsigned char* image, int width, int height, float tmin, float tmax);
+      void renderAdaptivePaths(unsigned char* image, int width, int height, float tmin, float tmax);
+      // light arriving along r, as rgb where 1 is full brightness; every random choice is drawn from sample
+      Vector3 pathRadiance(Ray r, float t0, float tf, SampleSequence& sample);
+      // light the lights send towards -viewDir from a hit with the given normal and albedo,
+      // one shadow ray per light kind
+      Vector3 directLight(HitRecord& rec, Vector3 normal, Vector3 viewDir, Material& mat, float t0, float tf, SampleSequence& sample);
+      // whether directLight samples the emission of surface, i.e. it is one of areaLights
+      bool isAreaLight(Surface* surface);
+      // the closest hit of r, counted and logged like every ray of rayColor
+      bool traceRay(Ray r, float t0, float tf, int depth, PixelProbe* probe, HitRecord& rec);
+      // color seen along r given its closest hit, or a miss when found is false
+      Color hitColor(Ray r, HitRecord& rec, bool found, float t0, float tf, int depth, PixelProbe* probe,
+         std::vector<GBufferHit>* hits, int* lit);
+      // ambient, plus diffuse and specular where the light is not blocked; when lit is given
+      // and not negative it says whether the light gets through, otherwise the shadow is
+      // looked up or traced and its outcome stored there. Other lights, emissive spheres and
+      // the material's own emission are added on top
+      Color shadeHit(GBufferHit& hit, float t0, float tf, int depth, PixelProbe* probe, int* lit);
+      // diffuse and specular from the lights in lights, within shadowBudget shadow rays
+      Color shadeLights(GBufferHit& hit, float t0, float tf, int depth, PixelProbe* probe);
+      // soft diffuse and specular from the emissive spheres in areaLights
+      Color shadeAreaLights(GBufferHit& hit, float t0, float tf, int depth, PixelProbe* probe);
+      Color shadeChain(GBufferHit* hits, int count, float t0, float tf);
+      // supersamples the pixels on edges of the image renderTiles just wrote
+      void antialiasEdges(unsigned char* image, int width, int height, float tmin, float tmax);
+      bool edgeBetween(const unsigned char* image, int p, int q);
+      void writeHeatmap(int width, int height);
+      std::string tuningKey(int width, int height);
+      bool loadSettings(int width, int height);
+      void saveSettings(int width, int height, RenderSettings settings);
+};
+
+#endif
@@ -0,0 +1,119 @@
+#include "SceneGenerator.h"
+#include <cmath>
+#include <algorithm>
+
+// xorshift so scenes do not depend on the standard library's generators
+class SceneRandom {
+   public:
+      unsigned state;
+
+      SceneRandom(unsigned seed) {
+         state = seed * 2654435761u + 1;
+      }
+
+      // uniform in [0, 1)
+      float next() {
+         state ^= state << 13;
+         state ^= state >> 17;
+         state ^= state << 5;
+         return (state >> 8) / 16777216.0f;
+      }
+
+      float range(float lo, float hi) {
+         return lo + (hi - lo) * next();
+      }
+
+      Vector3 point(float extent) {
+         float x = range(-extent, extent);
+         float y = range(-extent, extent);
+         float z = range(-extent, extent);
+         return Vector3(x, y, z);
+      }
+};
+
+// half the edge length of the cube every scene is generated in
+const float EXTENT = 10.0;
+
+static float heightAt(float x, float z) {
+   return 1.5f * sinf(0.6f * x) * cosf(0.4f * z) + 0.5f * sinf(1.7f * x + 2.3f * z);
+}
+
+const char* syntheticKindName(SyntheticKind kind) {
+   switch (kind) {
+      case SYNTH_SPHERES: return "spheres";
+      case SYNTH_SPHERE_SET: return "sphere_set";
+      case SYNTH_TRIANGLE_SOUP: return "triangle_soup";
+      case SYNTH_TETRA_GRID: return "tetra_grid";
+      case SYNTH_MESH: return "mesh";
+   }
+   return "unknown";
+}
+
+void generateScene(SyntheticKind kind, int n, unsigned seed, int materialId, std::vector<Surface*>& surfaces) {
+   SceneRandom rng(seed);
+   n = std::max(n, 1);
+   // primitive size shrinks with their number so the volume stays similarly full
+   float spacing = 2.0f * EXTENT / cbrtf((float) n);
+
+   if (kind == SYNTH_SPHERES || kind == SYNTH_SPHERE_SET) {
+      SphereSet* set = kind == SYNTH_SPHERE_SET ? new SphereSet() : NULL;
+      for (int k = 0; k < n; k++) {
+         Vector3 center = rng.point(EXTENT);
+         float r = rng.range(0.1f, 0.4f) * spacing;
+         if (set != NULL) {
+            set->add(center, r, materialId);
+         }
+         else {
+            surfaces.push_back(new Sphere(r, center, materialId));
+         }
+      }
+      if (set != NULL) {
+         surfaces.push_back(set);
+      }
+   }
+   else if (kind == SYNTH_TRIANGLE_SOUP) {
+      for (int k = 0; k < n; k++) {
+         Vector3 a = rng.point(EXTENT);
+         Vector3 b = a + rng.point(0.5f * spacing);
+         Vector3 c = a + rng.point(0.5f * spacing);
+         surfaces.push_back(new Triangle(a, b, c, materialId));
+      }
+   }
+   else if (kind == SYNTH_TETRA_GRID) {
+      // same shape as the demo tetrahedron, scaled into lattice cells
+      int tetras = std::max(1, n / 4);
+      int side = (int) ceilf(cbrtf((float) tetras));
+      float cell = 2.0f * EXTENT / side;
+      for (int k = 0; k < tetras; k++) {
+         Vector3 corner(-EXTENT + cell * (k % side), -EXTENT + cell * (k / side % side), -EXTENT + cell * (k / (side * side)));
+         float s = cell / 6.0f * rng.range(0.7f, 1.0f);
+         Vector3 t1 = corner + Vector3(0.5, 0.5, 2.0) * s, t2 = corner + Vector3(3.5, 0.5, 5.0) * s;
+         Vector3 t3 = corner + Vector3(5.5, 0.5, 1.0) * s, t4 = corner + Vector3(2.5, 5.5, 3.0) * s;
+         surfaces.push_back(new Triangle(t1, t2, t4, materialId));
+         surfaces.push_back(new Triangle(t1, t3, t2, materialId));
+         surfaces.push_back(new Triangle(t4, t3, t1, materialId));
+         surfaces.push_back(new Triangle(t3, t4, t2, materialId));
+      }
+   }
+   else if (kind == SYNTH_MESH) {
+      // two triangles per quad of a side x side height field with a little jitter
+      int side = std::max(1, (int) sqrtf(n / 2.0f));
+      float step = 2.0f * EXTENT / side;
+      std::vector<Vector3> verts((side + 1) * (side + 1));
+      for (int z = 0; z <= side; z++) {
+         for (int x = 0; x <= side; x++) {
+            float px = -EXTENT + step * x;
+            float pz = -EXTENT + step * z;
+            verts[z * (side + 1) + x] = Vector3(px, heightAt(px, pz) + rng.range(-0.05f, 0.05f) * step, pz);
+         }
+      }
+      for (int z = 0; z < side; z++) {
+         for (int x = 0; x < side; x++) {
+            Vector3 v00 = verts[z * (side + 1) + x], v10 = verts[z * (side + 1) + x + 1];
+            Vector3 v01 = verts[(z + 1) * (side + 1) + x], v11 = verts[(z + 1) * (side + 1) + x + 1];
+            surfaces.push_back(new Triangle(v00, v01, v10, materialId));
+            surfaces.push_back(new Triangle(v10, v01, v11, materialId));
+         }
+      }
+   }
+}
@@ -0,0 +1,28 @@
+#ifndef SCENEGENERATOR_H
+#define SCENEGENERATOR_H
+
+#include "RayTracer.h"
+#include <vector>
+
+// procedural test scenes for scaling measurements; all of them fill roughly the same
+// 20 unit cube around the origin that the demo scene occupies
+enum SyntheticKind {
+   // separate Sphere surfaces
+   SYNTH_SPHERES,
+   // the same spheres packed into one SphereSet
+   SYNTH_SPHERE_SET,
+   // small randomly oriented triangles scattered through the volume
+   SYNTH_TRIANGLE_SOUP,
+   // a regular lattice of tetrahedra, four triangles each
+   SYNTH_TETRA_GRID,
+   // one connected height field mesh, neighbouring triangles share vertices
+   SYNTH_MESH
+};
+
+const char* syntheticKindName(SyntheticKind kind);
+
+// appends about n primitives of the given kind to surfaces; the same seed always gives
+// the same scene. The caller owns the new surfaces.
+void generateScene(SyntheticKind kind, int n, unsigned seed, int materialId, std::vector<Surface*>& surfaces);
+
+#endif
@@ -0,0 +1,624 @@
+// Headless benchmark suite; prints one JSON document so results can be tracked over time.
+//
+// usage: ./benchmark.out [--reps N] [--filter substring] [--out file.json]
+//        ./benchmark.out --scaling [--max-n N] [--out file.json]
+//        ./benchmark.out --convergence [--out file.json]
+#include "RayTracer.h"
+#include "Acceleration.h"
+#include "SceneGenerator.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <functional>
+
+class BenchmarkResult {
+   public:
+      std::string name;
+      // "ray" for anything that traces or intersects rays, "sample" for path traced
+      // samples, "op" otherwise
+      std::string unit;
+      long long opsPerRep;
+      std::vector<double> nsPerOp;
+
+      double mean();
+      double variance();
+      double min();
+};
+
+// one synthetic scene size traced with one accelerator
+class ScalingResult {
+   public:
+      std::string scene;
+      std::string accel;
+      int primitives;
+      double buildMillis;
+      size_t accelBytes;
+      size_t geometryBytes;
+      long long rays;
+      double raysPerSec;
+};
+
+// error of one sampler at one sample count, on an integrand with a known or reference value
+class ConvergenceResult {
+   public:
+      std::string sampler;
+      std::string integrand;
+      int samples;
+      double rmse;
+};
+
+std::vector<Ray> randomRays(int count, Vector3 target, float spread, unsigned seed);
+std::vector<Light*> randomLights(int count, unsigned seed);
+Scene* demoScene(int width, int height, bool grid);
+void runBenchmark(const char* name, const char* unit, long long opsPerRep, std::function<float()> body);
+void writeJson(FILE* f);
+void runScaling(int maxN);
+void writeScalingJson(FILE* f);
+void runConvergence();
+void writeConvergenceJson(FILE* f);
+
+int reps = 10;
+const char* filter = NULL;
+std::vector<BenchmarkResult> results;
+std::vector<ScalingResult> scalingResults;
+std::vector<ConvergenceResult> convergenceResults;
+// keeps the compiler from discarding the benchmarked work
+volatile float sink;
+
+int main(int argc, char** argv) {
+   const char* outPath = NULL;
+   bool scaling = false;
+   bool convergence = false;
+   int maxN = 100000;
+   for (int i = 1; i < argc; i++) {
+      if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc) {
+         reps = std::max(2, atoi(argv[++i]));
+      }
+      else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+         filter = argv[++i];
+      }
+      else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+         outPath = argv[++i];
+      }
+      else if (strcmp(argv[i], "--scaling") == 0) {
+         scaling = true;
+      }
+      else if (strcmp(argv[i], "--convergence") == 0) {
+         convergence = true;
+      }
+      else if (strcmp(argv[i], "--max-n") == 0 && i + 1 < argc) {
+         maxN = atoi(argv[++i]);
+      }
+      else {
+         fprintf(stderr, "usage: %s [--reps N] [--filter substring] [--out file.json]\n"
+            "       %s --scaling [--max-n N] [--out file.json]\n"
+            "       %s --convergence [--out file.json]\n", argv[0], argv[0], argv[0]);
+         return 1;
+      }
+   }
+   FILE* out = stdout;
+   if (outPath != NULL) {
+      out = fopen(outPath, "w");
+      if (out == NULL) {
+         fprintf(stderr, "could not open %s\n", outPath);
+         return 1;
+      }
+   }
+   if (scaling) {
+      runScaling(maxN);
+      writeScalingJson(out);
+      if (out != stdout) {
+         fclose(out);
+      }
+      return 0;
+   }
+   if (convergence) {
+      runConvergence();
+      writeConvergenceJson(out);
+      if (out != stdout) {
+         fclose(out);
+      }
+      return 0;
+   }
+
+   // micro kernels
+   const int n = 1 << 16;
+   std::vector<Ray> rays = randomRays(n, Vector3(0.0, 0.0, 0.0), 4.0, 1);
+   Sphere sphere(3.0, Vector3(0.0, 0.0, 0.0), 0);
+   Triangle triangle(Vector3(-3.0, -3.0, 0.0), Vector3(3.0, -3.0, 0.0), Vector3(0.0, 3.0, 0.0), 0);
+   Plane plane(Vector3(0.0, 0.0, 0.0), Vector3(1.0, 0.0, 0.0), Vector3(0.0, 1.0, 0.0), 0);
+   Surface* kernels[3] = {&sphere, &triangle, &plane};
+   const char* kernelNames[3] = {"Sphere::hit", "Triangle::hit", "Plane::hit"};
+   for (int k = 0; k < 3; k++) {
+      Surface* s = kernels[k];
+      runBenchmark(kernelNames[k], "ray", n, [&]() {
+         float sum = 0.0;
+         HitRecord rec;
+         for (int i = 0; i < n; i++) {
+            if (s->hit(rays[i], 0.0001, 10000.0, rec)) {
+               sum += rec.t;
+            }
+         }
+         return sum;
+      });
+   }
+
+   runBenchmark("Vector3::dot", "op", n, [&]() {
+      float sum = 0.0;
+      for (int i = 0; i < n; i++) {
+         sum += Vector3::dot(rays[i].dir, rays[i].origin);
+      }
+      return sum;
+   });
+   runBenchmark("Vector3::cross", "op", n, [&]() {
+      float sum = 0.0;
+      for (int i = 0; i < n; i++) {
+         sum += Vector3::cross(rays[i].dir, rays[i].origin).x;
+      }
+      return sum;
+   });
+   runBenchmark("Vector3::normalized", "op", n, [&]() {
+      float sum = 0.0;
+      for (int i = 0; i < n; i++) {
+         sum += rays[i].origin.normalized().x;
+      }
+      return sum;
+   });
+   runBenchmark("Vector3::operator+-*", "op", n, [&]() {
+      Vector3 acc;
+      for (int i = 0; i < n; i++) {
+         acc = acc + rays[i].dir * 0.5f - rays[i].origin / 4.0f;
+      }
+      return acc.x + acc.y + acc.z;
+   });
+
+   Scene* scene = demoScene(512, 512, false);
+   Camera* cams[2] = {&scene->orthoCam, &scene->perCam};
+   const char* camNames[2] = {"OrthographicCamera::viewRay", "PerspectiveCamera::viewRay"};
+   for (int k = 0; k < 2; k++) {
+      Camera* cam = cams[k];
+      runBenchmark(camNames[k], "ray", 512 * 512, [&]() {
+         float sum = 0.0;
+         for (int y = 0; y < 512; y++) {
+            for (int x = 0; x < 512; x++) {
+               sum += cam->viewRay(x, y).dir.z;
+            }
+         }
+         return sum;
+      });
+   }
+
+   // whole-ray shading of the demo scene, once per pixel of both cameras
+   for (int g = 0; g < 2; g++) {
+      Scene* s = g ? demoScene(512, 512, true) : scene;
+      s->beginFrame();
+      std::string name = std::string("Scene::rayColor/demo/") + (g ? "grid" : "list");
+      runBenchmark(name.c_str(), "ray", 2 * 512 * 512, [&]() {
+         float sum = 0.0;
+         for (int k = 0; k < 2; k++) {
+            for (int y = 0; y < 512; y++) {
+               for (int x = 0; x < 512; x++) {
+                  sum += s->rayColor(cams[k]->viewRay(x, y), 0.0001, 10000.0).red;
+               }
+            }
+         }
+         return sum;
+      });
+      if (g) {
+         delete s;
+      }
+   }
+   delete scene;
+
+   // shadow queries at the demo scene's primary hits, traced through the grid, and looked
+   // up in a shadow map with a ray wherever the map cannot tell
+   Scene* shadowScene = demoScene(512, 512, false);
+   UniformGrid shadowGrid(true);
+   shadowGrid.build(shadowScene->surfaces);
+   ShadowMap shadowMap;
+   shadowMap.update(*shadowScene, geometryHash(shadowScene->surfaces), 1024);
+   Vector3 lightDir = shadowScene->lightSource.dir.normalized();
+   std::vector<GBufferHit> shadowHits;
+   for (int y = 0; y < 512; y++) {
+      for (int x = 0; x < 512; x++) {
+         Ray r = shadowScene->orthoCam.viewRay(x, y);
+         HitRecord rec;
+         if (shadowGrid.hit(r, 0.0001, 10000.0, rec)) {
+            GBufferHit hit;
+            hit.surface = rec.surface;
+            hit.index = rec.index;
+            hit.pos = rec.pos;
+            shadowHits.push_back(hit);
+         }
+      }
+   }
+   runBenchmark("UniformGrid::occluded/demo", "ray", shadowHits.size(), [&]() {
+      float sum = 0.0;
+      for (int i = 0; i < shadowHits.size(); i++) {
+         sum += shadowGrid.occluded(Ray(shadowHits[i].pos, lightDir), 0.0001, 10000.0);
+      }
+      return sum;
+   });
+   runBenchmark("ShadowMap::lookup/demo", "ray", shadowHits.size(), [&]() {
+      float sum = 0.0;
+      for (int i = 0; i < shadowHits.size(); i++) {
+         int known = shadowMap.lookup(shadowHits[i], 0.0001, 10000.0);
+         if (known < 0) {
+            known = !shadowGrid.occluded(Ray(shadowHits[i].pos, lightDir), 0.0001, 10000.0);
+         }
+         sum += known == 0;
+      }
+      return sum;
+   });
+   delete shadowScene;
+
+   // full frames at several resolutions
+   int sizes[4] = {128, 256, 512, 1024};
+   for (int k = 0; k < 4; k++) {
+      int size = sizes[k];
+      Scene* s = demoScene(size, size, false);
+      std::vector<unsigned char> image(size * size * 3);
+      std::string name = "Scene::render/" + std::to_string(size) + "x" + std::to_string(size);
+      runBenchmark(name.c_str(), "ray", (long long) size * size, [&]() {
+         s->render(image.data(), size, size, 0.0001, 10000.0);
+         return (float) image[image.size() / 2];
+      });
+      delete s;
+   }
+
+   // edge antialiasing on top of a 256 pixel frame, against shooting 4 rays through every
+   // pixel of the same frame (a 512 pixel render); both per pixel of the final image
+   {
+      Scene* s = demoScene(256, 256, false);
+      s->antialias = true;
+      std::vector<unsigned char> image(256 * 256 * 3);
+      runBenchmark("Scene::render/antialias/256x256", "ray", 256 * 256, [&]() {
+         s->render(image.data(), 256, 256, 0.0001, 10000.0);
+         return (float) image[image.size() / 2];
+      });
+      delete s;
+   }
+
+   // path traced frames of the demo scene, per sample
+   {
+      Scene* s = demoScene(128, 128, true);
+      s->integrator = INTEGRATOR_PATH;
+      s->samplesPerPixel = 16;
+      std::vector<unsigned char> image(128 * 128 * 3);
+      runBenchmark("Scene::render/path/128x128x16", "sample", 128 * 128 * 16, [&]() {
+         s->render(image.data(), 128, 128, 0.0001, 10000.0);
+         return (float) image[image.size() / 2];
+      });
+      // the same budget spent adaptively; the error threshold is low enough for the demo
+      // scene that the whole budget is used
+      s->adaptiveSampling = true;
+      runBenchmark("Scene::render/path/adaptive/128x128x16", "sample", 128 * 128 * 16, [&]() {
+         s->render(image.data(), 128, 128, 0.0001, 10000.0);
+         return (float) image[image.size() / 2];
+      });
+      delete s;
+   }
+
+   // the demo scene lit by more and more point lights of the same reach; frame time should
+   // follow the lights reaching each hit, not the lights in the scene
+   int lightCounts[3] = {16, 256, 4096};
+   for (int k = 0; k < 3; k++) {
+      Scene* s = demoScene(256, 256, true);
+      std::vector<Light*> lights = randomLights(lightCounts[k], 2);
+      s->lights = lights;
+      std::vector<unsigned char> image(256 * 256 * 3);
+      std::string name = "Scene::render/lights/" + std::to_string(lightCounts[k]);
+      runBenchmark(name.c_str(), "ray", 256 * 256, [&]() {
+         s->render(image.data(), 256, 256, 0.0001, 10000.0);
+         return (float) image[image.size() / 2];
+      });
+      delete s;
+      for (int i = 0; i < lights.size(); i++) {
+         delete lights[i];
+      }
+   }
+
+   writeJson(out);
+   if (out != stdout) {
+      fclose(out);
+   }
+   return 0;
+}
+
+std::vector<Ray> randomRays(int count, Vector3 target, float spread, unsigned seed) {
+   // rays from a shell around the target, aimed at jittered points near it so roughly
+   // half of them hit a primitive of radius spread
+   srand(seed);
+   std::vector<Ray> rays;
+   for (int i = 0; i < count; i++) {
+      Vector3 dir(rand() / (float) RAND_MAX - 0.5f, rand() / (float) RAND_MAX - 0.5f, rand() / (float) RAND_MAX - 0.5f);
+      Vector3 origin = target + dir.normalized() * 20.0f;
+      Vector3 aim = target + Vector3(rand() / (float) RAND_MAX - 0.5f, rand() / (float) RAND_MAX - 0.5f,
+         rand() / (float) RAND_MAX - 0.5f) * (2.0f * spread);
+      rays.push_back(Ray(origin, aim - origin));
+   }
+   return rays;
+}
+
+std::vector<Light*> randomLights(int count, unsigned seed) {
+   // point lights of range 4 scattered just above the demo scene's floor, every third one a
+   // spot light pointing down; the total light stays about the same whatever the count
+   srand(seed);
+   std::vector<Light*> lights;
+   float intensity = 32.0f / std::max(16, count);
+   for (int i = 0; i < count; i++) {
+      Vector3 pos(rand() / (float) RAND_MAX * 24.0f - 12.0f, rand() / (float) RAND_MAX * 8.0f + 0.5f,
+         rand() / (float) RAND_MAX * 24.0f - 12.0f);
+      if (i % 3 == 2) {
+         lights.push_back(new SpotLight(3.0f * intensity, pos, 6.0, Vector3(0.0, -1.0, 0.0), 0.3, 0.6));
+      }
+      else {
+         lights.push_back(new PointLight(intensity, pos, 4.0));
+      }
+   }
+   return lights;
+}
+
+Scene* demoScene(int width, int height, bool grid) {
+   // same settings as render.cpp
+   DirectionalLight lightSource(1.0, Vector3(2.0, 4.0, 2.0));
+   Vector3 viewDir(0.0, -0.2, -1.0), up(0.0, 1.0, 0.0), viewPoint(0.0, 10.0, 50.0);
+   Scene* scene = new Scene(10.0, viewPoint, up, viewDir, 10.0, -10.0, -10.0, 10.0, width, height, lightSource);
+   if (grid) {
+      scene->setAccelerator(new UniformGrid(true));
+   }
+   return scene;
+}
+
+void runBenchmark(const char* name, const char* unit, long long opsPerRep, std::function<float()> body) {
+   if (filter != NULL && strstr(name, filter) == NULL) {
+      return;
+   }
+   BenchmarkResult result;
+   result.name = name;
+   result.unit = unit;
+   result.opsPerRep = opsPerRep;
+
+   // one untimed warm-up repetition
+   sink = body();
+   for (int r = 0; r < reps; r++) {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      sink = body();
+      double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+      result.nsPerOp.push_back(ns / opsPerRep);
+   }
+   fprintf(stderr, "%-36s %10.2f ns/%s\n", name, result.mean(), unit);
+   results.push_back(result);
+}
+
+void writeJson(FILE* f) {
+   fprintf(f, "{\n");
+   fprintf(f, "  \"context\": {\"compiler\": \"%s\", \"avx\": %s, \"repetitions\": %d},\n", __VERSION__,
+#ifdef __AVX__
+      "true",
+#else
+      "false",
+#endif
+      reps);
+   fprintf(f, "  \"benchmarks\": [\n");
+   for (int k = 0; k < results.size(); k++) {
+      BenchmarkResult& r = results[k];
+      const char* u = r.unit.c_str();
+      fprintf(f, "    {\"name\": \"%s\", \"unit\": \"%s\", \"%ss_per_rep\": %lld, \"ns_per_%s\": %.4f, "
+         "\"ns_per_%s_min\": %.4f, \"ns_per_%s_variance\": %.6f, \"%ss_per_sec\": %.1f}%s\n",
+         r.name.c_str(), u, u, r.opsPerRep, u, r.mean(), u, r.min(), u, r.variance(), u, 1e9 / r.mean(),
+         k + 1 < results.size() ? "," : "");
+   }
+   fprintf(f, "  ]\n}\n");
+}
+
+void runScaling(int maxN) {
+   // every synthetic scene kind from 100 primitives up by factors of ten, traced with
+   // each accelerator through a perspective camera that sees the whole volume
+   const int size = 128;
+   const double timeBudgetMillis = 1000.0;
+   SyntheticKind kinds[5] = {SYNTH_SPHERES, SYNTH_SPHERE_SET, SYNTH_TRIANGLE_SOUP, SYNTH_TETRA_GRID, SYNTH_MESH};
+   const char* accelNames[3] = {"list", "grid", "grid2"};
+   for (int k = 0; k < 5; k++) {
+      for (int n = 100; n <= maxN; n *= 10) {
+         std::vector<Surface*> surfaces;
+         // material 1 is the first one the demo scene registers; 0 would shade everything black
+         generateScene(kinds[k], n, 1, 1, surfaces);
+         size_t geometry = 0;
+         int primitives = 0;
+         for (int s = 0; s < surfaces.size(); s++) {
+            geometry += surfaces[s]->memoryBytes();
+            primitives += surfaces[s]->primitiveCount();
+         }
+         for (int a = 0; a < 3; a++) {
+            Scene* scene = demoScene(size, size, false);
+            scene->surfaces = surfaces;
+            // pull the perspective camera out of the generated volume
+            Vector3 eye(0.0, 6.0, 24.0);
+            scene->cam = &scene->perCam;
+            scene->cam->changeOrientation(eye, Vector3(0.0, 1.0, 0.0), (Vector3(0.0, 0.0, 0.0) - eye).normalized());
+            Accelerator* accel = a == 0 ? (Accelerator*) new SurfaceList() : new UniformGrid(a == 2);
+            scene->setAccelerator(accel);
+
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            scene->beginFrame();
+            double buildMillis = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+            // whole rows until the frame is done or the time budget is used up
+            long long rays = 0;
+            float sum = 0.0;
+            double millis = 0.0;
+            start = std::chrono::steady_clock::now();
+            for (int y = 0; y < size && millis < timeBudgetMillis; y++) {
+               for (int x = 0; x < size; x++) {
+                  sum += scene->rayColor(scene->cam->viewRay(x, y), 0.0001, 10000.0).red;
+               }
+               rays += size;
+               millis = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            }
+            sink = sum;
+
+            ScalingResult result;
+            result.scene = syntheticKindName(kinds[k]);
+            result.accel = accelNames[a];
+            result.primitives = primitives;
+            result.buildMillis = buildMillis;
+            result.accelBytes = accel->memoryBytes();
+            result.geometryBytes = geometry;
+            result.rays = rays;
+            result.raysPerSec = rays / (millis / 1000.0);
+            scalingResults.push_back(result);
+            fprintf(stderr, "%-14s %8d %-6s build %10.2f ms  accel %10.1f KiB  %12.0f rays/s\n", result.scene.c_str(),
+               primitives, accelNames[a], buildMillis, result.accelBytes / 1024.0, result.raysPerSec);
+            delete scene;
+         }
+         for (int s = 0; s < surfaces.size(); s++) {
+            delete surfaces[s];
+         }
+      }
+   }
+}
+
+void writeScalingJson(FILE* f) {
+   fprintf(f, "{\n");
+   fprintf(f, "  \"context\": {\"compiler\": \"%s\", \"avx\": %s, \"seed\": 1},\n", __VERSION__,
+#ifdef __AVX__
+      "true"
+#else
+      "false"
+#endif
+      );
+   fprintf(f, "  \"scaling\": [\n");
+   for (int k = 0; k < scalingResults.size(); k++) {
+      ScalingResult& r = scalingResults[k];
+      fprintf(f, "    {\"scene\": \"%s\", \"accel\": \"%s\", \"primitives\": %d, \"build_ms\": %.3f, "
+         "\"accel_bytes\": %zu, \"geometry_bytes\": %zu, \"rays\": %lld, \"rays_per_sec\": %.1f}%s\n",
+         r.scene.c_str(), r.accel.c_str(), r.primitives, r.buildMillis, r.accelBytes, r.geometryBytes, r.rays,
+         r.raysPerSec, k + 1 < scalingResults.size() ? "," : "");
+   }
+   fprintf(f, "  ]\n}\n");
+}
+
+void runConvergence() {
+   // the quarter disk x^2 + y^2 < 1 in the unit square, a pi / 4 area with an edge across both
+   // dimensions, estimated independently for many pixels; then path traced frames of the demo
+   // scene against a reference frame from many more random samples
+   SamplerKind kinds[3] = {SAMPLER_RANDOM, SAMPLER_SOBOL, SAMPLER_PMJ};
+   const char* kindNames[3] = {"random", "sobol", "pmj"};
+   const int pixels = 4096;
+   for (int k = 0; k < 3; k++) {
+      Sampler sampler(kinds[k], 1);
+      for (int n = 1; n <= 1024; n *= 4) {
+         double squared = 0.0;
+         for (int p = 0; p < pixels; p++) {
+            int inside = 0;
+            for (int i = 0; i < n; i++) {
+               float u, v;
+               sampler.get2D(p, i, 0, u, v);
+               inside += u * u + v * v < 1.0f;
+            }
+            double error = inside / (double) n - M_PI / 4.0;
+            squared += error * error;
+         }
+         ConvergenceResult result;
+         result.sampler = kindNames[k];
+         result.integrand = "quarter_disk";
+         result.samples = n;
+         result.rmse = sqrt(squared / pixels);
+         convergenceResults.push_back(result);
+         fprintf(stderr, "%-12s %-7s %5d spp  rmse %.6f\n", "quarter_disk", kindNames[k], n, result.rmse);
+      }
+   }
+
+   const int size = 64;
+   std::vector<unsigned char> reference(size * size * 3), image(size * size * 3);
+   Scene* scene = demoScene(size, size, true);
+   scene->integrator = INTEGRATOR_PATH;
+   scene->sampler = Sampler(SAMPLER_RANDOM, 12345);
+   scene->samplesPerPixel = 1024;
+   scene->render(reference.data(), size, size, 0.0001, 10000.0);
+   for (int k = 0; k < 3; k++) {
+      scene->sampler = Sampler(kinds[k], 1);
+      for (int n = 1; n <= 64; n *= 4) {
+         scene->samplesPerPixel = n;
+         scene->render(image.data(), size, size, 0.0001, 10000.0);
+         // in 8 bit channel steps; the reference's own noise puts a floor under the error
+         double squared = 0.0;
+         for (int i = 0; i < image.size(); i++) {
+            double error = image[i] - (double) reference[i];
+            squared += error * error;
+         }
+         ConvergenceResult result;
+         result.sampler = kindNames[k];
+         result.integrand = "path_demo";
+         result.samples = n;
+         result.rmse = sqrt(squared / image.size());
+         convergenceResults.push_back(result);
+         fprintf(stderr, "%-12s %-7s %5d spp  rmse %.6f\n", "path_demo", kindNames[k], n, result.rmse);
+      }
+   }
+   // the same average sample counts spent by adaptive sampling
+   scene->sampler = Sampler(SAMPLER_SOBOL, 1);
+   scene->adaptiveSampling = true;
+   for (int n = 4; n <= 64; n *= 4) {
+      scene->samplesPerPixel = n;
+      scene->render(image.data(), size, size, 0.0001, 10000.0);
+      double squared = 0.0;
+      for (int i = 0; i < image.size(); i++) {
+         double error = image[i] - (double) reference[i];
+         squared += error * error;
+      }
+      ConvergenceResult result;
+      result.sampler = "sobol_adaptive";
+      result.integrand = "path_demo";
+      result.samples = n;
+      result.rmse = sqrt(squared / image.size());
+      convergenceResults.push_back(result);
+      fprintf(stderr, "%-12s %-7s %5d spp  rmse %.6f\n", "path_demo", "adaptive", n, result.rmse);
+   }
+   delete scene;
+}
+
+void writeConvergenceJson(FILE* f) {
+   fprintf(f, "{\n");
+   fprintf(f, "  \"context\": {\"compiler\": \"%s\", \"seed\": 1},\n", __VERSION__);
+   fprintf(f, "  \"convergence\": [\n");
+   for (int k = 0; k < convergenceResults.size(); k++) {
+      ConvergenceResult& r = convergenceResults[k];
+      fprintf(f, "    {\"integrand\": \"%s\", \"sampler\": \"%s\", \"samples\": %d, \"rmse\": %.6f}%s\n",
+         r.integrand.c_str(), r.sampler.c_str(), r.samples, r.rmse, k + 1 < convergenceResults.size() ? "," : "");
+   }
+   fprintf(f, "  ]\n}\n");
+}
+
+//////////////////////
+// Benchmark Result //
+//////////////////////
+double BenchmarkResult::mean() {
+   double sum = 0.0;
+   for (int k = 0; k < nsPerOp.size(); k++) {
+      sum += nsPerOp[k];
+   }
+   return sum / nsPerOp.size();
+}
+
+double BenchmarkResult::variance() {
+   // sample variance over repetitions
+   double m = mean(), sum = 0.0;
+   for (int k = 0; k < nsPerOp.size(); k++) {
+      sum += (nsPerOp[k] - m) * (nsPerOp[k] - m);
+   }
+   return sum / (nsPerOp.size() - 1);
+}
+
+double BenchmarkResult::min() {
+   double best = nsPerOp[0];
+   for (int k = 1; k < nsPerOp.size(); k++) {
+      best = std::min(best, nsPerOp[k]);
+   }
+   return best;
+}
@@ -10,6 +10,7 @@
 #include "stb_image/stb_image_write.h"
 
 #include "RayTracer.h"
+#include "Acceleration.h"
 #define _USE_MATH_DEFINES
 #include <math.h>
 #include <array>
@@ -17,15 +18,21 @@
 #include <algorithm>
 #include <iostream>
 #include <string>
+#include <cstring>
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void processInput(GLFWwindow *window);
 void saveImage(char* filepath, GLFWwindow* w);
+void writePng(const char* filepath, int width, int height, const void* data, int stride);
 
 // settings
 const unsigned int SCR_WIDTH = 800;
 const unsigned int SCR_HEIGHT = 800;
 
+// largest framebuffer readback and encoded PNG so far, reported with the scene's memory
+size_t readbackBytes = 0;
+size_t pngBytes = 0;
+
 const char *vertexShaderSource = "#version 330 core\n"
    "layout (location = 0) in vec3 aPos;\n"
    "layout (location = 1) in vec3 aColor;\n"
@@ -50,7 +57,34 @@ const char *fragmentShaderSource = "#version 330 core\n"
    "}\n\0";
     
 
-int main() {
+int main(int argc, char** argv) {
+   // --heatmap cycles|tests also writes a false-colored per-pixel cost image,
+   // --trace file.json records a Chrome / Perfetto timeline of the run, --autotune times a
+   // sweep of render settings on the first frame and stores the fastest in cache/ for later runs,
+   // --reproject reuses the previous frame's primary hits and shadows where they still hold,
+   // --antialias supersamples the pixels on edges
+   HeatmapMode heatmapMode = HEATMAP_OFF;
+   bool autotune = false;
+   bool reproject = false;
+   bool antialias = false;
+   for (int i = 1; i < argc; i++) {
+      if (strcmp(argv[i], "--heatmap") == 0 && i + 1 < argc) {
+         heatmapMode = strcmp(argv[i + 1], "tests") == 0 ? HEATMAP_TESTS : HEATMAP_CYCLES;
+      }
+      else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+         Trace::enable(argv[i + 1]);
+      }
+      else if (strcmp(argv[i], "--autotune") == 0) {
+         autotune = true;
+      }
+      else if (strcmp(argv[i], "--reproject") == 0) {
+         reproject = true;
+      }
+      else if (strcmp(argv[i], "--antialias") == 0) {
+         antialias = true;
+      }
+   }
+
    // glfw: initialize and configure
    // ------------------------------
    glfwInit();
@@ -170,6 +204,7 @@ int main() {
     int width, height;
     width = 512; height = 512; // keep it in powers of 2!
     unsigned char image[width*height*3];
+    unsigned char heatmap[width*height*3];
 
     // create light source
     float intensity = 1.0;
@@ -185,6 +220,13 @@ int main() {
 
    // create scene
    Scene scene(distToCam, viewPoint, up, viewDir, t, b, l, r, width, height, lightSource);
+   scene.setHeatmap(heatmap, heatmapMode);
+   scene.tuningDir = "cache";
+   scene.reproject = reproject;
+   scene.antialias = antialias;
+   UniformGrid* grid = new UniformGrid(true);
+   grid->cacheDir = "cache";
+   scene.setAccelerator(grid);
    int fps = 60;
    int period = 12;
    int dur = 2;
@@ -201,7 +243,17 @@ int main() {
 
       // create and render scene
       scene.cam->changeOrientation(viewPoint, up, newViewDir);
+      if (n == 0 && autotune) {
+         scene.autotune(image, width, height, tmin, tmax);
+      }
       scene.render(image, width, height, tmin, tmax);
+      if (reproject) {
+         std::cout << "Frame " << n << ": " << 100.0 * scene.tracedFraction << "% of pixels traced" << std::endl;
+      }
+      if (n == 0) {
+         std::cout << "Time to first ray: " << scene.startupMillis << " ms (acceleration structure "
+            << (grid->loadedFromCache ? "loaded from cache" : "built") << " in " << grid->buildMillis << " ms)" << std::endl;
+      }
 
       unsigned char *data = &image[0];
       if (data) {
@@ -242,8 +294,16 @@ int main() {
       char fname[fnameTemp.length()];
       strcpy(fname, fnameTemp.c_str());
       saveImage(fname, window);
+      if (heatmapMode != HEATMAP_OFF) {
+         std::string heatName = "movie1/heat" + std::to_string(n) + ".png";
+         writePng(heatName.c_str(), width, height, heatmap, width * 3);
+      }
    }
 
+   MemoryReport memory = scene.memoryReport();
+   memory.bytes[MEM_OUTPUT] = readbackBytes + pngBytes;
+   memory.print(stdout);
+
    // optional: de-allocate all resources once they've outlived their purpose:
    // ------------------------------------------------------------------------
    glDeleteVertexArrays(1, &VAO);
@@ -281,9 +341,37 @@ void saveImage(char* filepath, GLFWwindow* w) {
    stride += (stride % 4) ? (4 - stride % 4) : 0;
    GLsizei bufferSize = stride * height;
    std::vector<char> buffer(bufferSize);
-   glPixelStorei(GL_PACK_ALIGNMENT, 4);
-   glReadBuffer(GL_BACK);
-   glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, buffer.data());
-   stbi_flip_vertically_on_write(true);
-   stbi_write_png(filepath, width, height, nrChannels, buffer.data(), stride);
+   readbackBytes = std::max(readbackBytes, buffer.capacity());
+   {
+      TraceScope readScope("read framebuffer");
+      glPixelStorei(GL_PACK_ALIGNMENT, 4);
+      glReadBuffer(GL_BACK);
+      glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, buffer.data());
+   }
+   writePng(filepath, width, height, buffer.data(), stride);
+}
+
+static void appendBytes(void* context, void* data, int size) {
+   std::vector<unsigned char>* png = (std::vector<unsigned char>*) context;
+   png->insert(png->end(), (unsigned char*) data, (unsigned char*) data + size);
+}
+
+// encodes in memory first so the trace shows encoding and file writing separately
+void writePng(const char* filepath, int width, int height, const void* data, int stride) {
+   std::vector<unsigned char> png;
+   {
+      TraceScope encodeScope("encode png");
+      RT_PERF_PHASE(PERF_ENCODE);
+      stbi_flip_vertically_on_write(true);
+      stbi_write_png_to_func(appendBytes, &png, width, height, 3, data, stride);
+      pngBytes = std::max(pngBytes, png.capacity());
+   }
+   TraceScope writeScope("write file");
+   FILE* f = fopen(filepath, "wb");
+   if (f == NULL) {
+      std::cout << "Failed to write " << filepath << std::endl;
+      return;
+   }
+   fwrite(png.data(), 1, png.size(), f);
+   fclose(f);
 }
\ No newline at end of file
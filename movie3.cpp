@@ -17,15 +17,21 @@
 #include <algorithm>
 #include <iostream>
 #include <string>
+#include <cstring>
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void processInput(GLFWwindow *window);
 void saveImage(char* filepath, GLFWwindow* w);
+void writePng(const char* filepath, int width, int height, const void* data, int stride);
 
 // settings
 const unsigned int SCR_WIDTH = 800;
 const unsigned int SCR_HEIGHT = 800;
 
+// largest framebuffer readback and encoded PNG so far, reported with the scene's memory
+size_t readbackBytes = 0;
+size_t pngBytes = 0;
+
 const char *vertexShaderSource = "#version 330 core\n"
    "layout (location = 0) in vec3 aPos;\n"
    "layout (location = 1) in vec3 aColor;\n"
@@ -50,7 +56,34 @@ const char *fragmentShaderSource = "#version 330 core\n"
    "}\n\0";
     
 
-int main() {
+int main(int argc, char** argv) {
+   // --heatmap cycles|tests also writes a false-colored per-pixel cost image,
+   // --trace file.json records a Chrome / Perfetto timeline of the run, --autotune times a
+   // sweep of render settings on the first frame and stores the fastest in cache/ for later runs,
+   // --area-light lights the scene from the sun sphere itself, with soft shadows, instead of a
+   // directional light aimed at it, --antialias supersamples the pixels on edges
+   HeatmapMode heatmapMode = HEATMAP_OFF;
+   bool autotune = false;
+   bool areaLight = false;
+   bool antialias = false;
+   for (int i = 1; i < argc; i++) {
+      if (strcmp(argv[i], "--heatmap") == 0 && i + 1 < argc) {
+         heatmapMode = strcmp(argv[i + 1], "tests") == 0 ? HEATMAP_TESTS : HEATMAP_CYCLES;
+      }
+      else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+         Trace::enable(argv[i + 1]);
+      }
+      else if (strcmp(argv[i], "--autotune") == 0) {
+         autotune = true;
+      }
+      else if (strcmp(argv[i], "--area-light") == 0) {
+         areaLight = true;
+      }
+      else if (strcmp(argv[i], "--antialias") == 0) {
+         antialias = true;
+      }
+   }
+
    // glfw: initialize and configure
    // ------------------------------
    glfwInit();
@@ -170,6 +203,7 @@ int main() {
    int width, height;
    width = 512; height = 512; // keep it in powers of 2!
    unsigned char image[width*height*3];
+   unsigned char heatmap[width*height*3];
 
    // create light source
    float intensity = 1.0;
@@ -185,17 +219,30 @@ int main() {
 
    // create scene
    Scene scene(distToCam, viewPoint, up, viewDir, t, b, l, r, width, height, lightSource);
+   scene.setHeatmap(heatmap, heatmapMode);
+   scene.tuningDir = "cache";
+   // the camera never moves, so frames after the first only redo shadows and shading,
+   // apart from pixels whose rays pass near the moving sun
+   scene.cacheHits = true;
+   scene.antialias = antialias;
+   // the light follows the sun slowly, so most shadow results carry over to the next frame
+   scene.cacheShadows = true;
 
    // add sun
    Vector3 sunPos(750.0, 2000.0, -1500.0);
    float sunRadius = 100.0;
    Color white(255, 255, 255);
    Material sunMaterial(white, white, white, 1.0, 1.0, 1.0, 1.0);
-   Sphere sun(sunRadius, sunPos, sunMaterial);
+   int sunMaterialId = scene.addMaterial(sunMaterial);
+   Sphere sun(sunRadius, sunPos, sunMaterialId);
+   sun.castsShadow = false;
    scene.surfaces.push_back(&sun);
 
-   // move light source to sphere center
+   // move light source to sphere center, or let the sun do the lighting
    scene.lightSource.dir = sunPos.normalized();
+   if (areaLight) {
+      scene.lightSource.intensity = 0.0;
+   }
 
    // switch to perspective camera
    scene.cam = &scene.perCam;
@@ -208,6 +255,7 @@ int main() {
    float finalHeight = -sunRadius * 2.0;
    float deltaHeight = (finalHeight - initialHeight) / (float) (dur * fps);
 
+   float tracedPixels = 0.0;
    for (int n = 0; n <= fps * dur; n++) {
 
       // calculate new sun height
@@ -215,11 +263,21 @@ int main() {
       sun.center = Vector3(750.0, sunHeight, -1500.0);
 
       // adjust light source
-      scene.lightSource.dir = sun.center.normalized();
-      scene.lightSource.intensity = 0.3 * (dur * fps - n) / (float) (dur * fps) + 0.7;
+      float sunIntensity = 0.3 * (dur * fps - n) / (float) (dur * fps) + 0.7;
+      if (areaLight) {
+         scene.materials[sunMaterialId].emission = sunIntensity;
+      }
+      else {
+         scene.lightSource.dir = sun.center.normalized();
+         scene.lightSource.intensity = sunIntensity;
+      }
 
       // render scene
+      if (n == 0 && autotune) {
+         scene.autotune(image, width, height, tmin, tmax);
+      }
       scene.render(image, width, height, tmin, tmax);
+      tracedPixels += scene.tracedFraction;
 
       unsigned char *data = &image[0];
       if (data) {
@@ -260,8 +318,17 @@ int main() {
       char fname[fnameTemp.length()];
       strcpy(fname, fnameTemp.c_str());
       saveImage(fname, window);
+      if (heatmapMode != HEATMAP_OFF) {
+         std::string heatName = "movie3/heat" + std::to_string(n) + ".png";
+         writePng(heatName.c_str(), width, height, heatmap, width * 3);
+      }
    }
 
+   std::cout << "Pixels traced: " << 100.0 * tracedPixels / (fps * dur + 1) << "% (the rest were reshaded from the G-buffer)" << std::endl;
+   MemoryReport memory = scene.memoryReport();
+   memory.bytes[MEM_OUTPUT] = readbackBytes + pngBytes;
+   memory.print(stdout);
+
    // optional: de-allocate all resources once they've outlived their purpose:
    // ------------------------------------------------------------------------
    glDeleteVertexArrays(1, &VAO);
@@ -299,9 +366,37 @@ void saveImage(char* filepath, GLFWwindow* w) {
    stride += (stride % 4) ? (4 - stride % 4) : 0;
    GLsizei bufferSize = stride * height;
    std::vector<char> buffer(bufferSize);
-   glPixelStorei(GL_PACK_ALIGNMENT, 4);
-   glReadBuffer(GL_BACK);
-   glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, buffer.data());
-   stbi_flip_vertically_on_write(true);
-   stbi_write_png(filepath, width, height, nrChannels, buffer.data(), stride);
+   readbackBytes = std::max(readbackBytes, buffer.capacity());
+   {
+      TraceScope readScope("read framebuffer");
+      glPixelStorei(GL_PACK_ALIGNMENT, 4);
+      glReadBuffer(GL_BACK);
+      glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, buffer.data());
+   }
+   writePng(filepath, width, height, buffer.data(), stride);
+}
+
+static void appendBytes(void* context, void* data, int size) {
+   std::vector<unsigned char>* png = (std::vector<unsigned char>*) context;
+   png->insert(png->end(), (unsigned char*) data, (unsigned char*) data + size);
+}
+
+// encodes in memory first so the trace shows encoding and file writing separately
+void writePng(const char* filepath, int width, int height, const void* data, int stride) {
+   std::vector<unsigned char> png;
+   {
+      TraceScope encodeScope("encode png");
+      RT_PERF_PHASE(PERF_ENCODE);
+      stbi_flip_vertically_on_write(true);
+      stbi_write_png_to_func(appendBytes, &png, width, height, 3, data, stride);
+      pngBytes = std::max(pngBytes, png.capacity());
+   }
+   TraceScope writeScope("write file");
+   FILE* f = fopen(filepath, "wb");
+   if (f == NULL) {
+      std::cout << "Failed to write " << filepath << std::endl;
+      return;
+   }
+   fwrite(png.data(), 1, png.size(), f);
+   fclose(f);
 }
\ No newline at end of file
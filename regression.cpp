@@ -0,0 +1,332 @@
+// Headless image regression; re-renders selected movie frames, compares them with the reference
+// PNGs in movie1/, movie2/ and movie3/ and checks each render against its time budget. Then
+// renders runs of consecutive frames with the caches and shortcuts that carry state between
+// frames and compares them with plain renders of the same frames.
+//
+// usage: ./regression.out [--all] [--reps N] [--budget-scale X] [--diff dir]
+// exits with status 1 if any frame misses its tolerance or its budget, or any cached frame
+// differs from the plain one by more than its case allows
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image/stb_image.h"
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image/stb_image_write.h"
+
+#include "RayTracer.h"
+#include "Acceleration.h"
+#define _USE_MATH_DEFINES
+#include <math.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
+
+// one frame of one movie, with what it may cost; budgets are generous multiples of the
+// single-threaded time so only real slowdowns trip them
+class RegressionCase {
+   public:
+      int movie;
+      int frame;
+      double budgetMillis;
+};
+
+class ImageDiff {
+   public:
+      int maxAbs;
+      // pixels with any channel off
+      int differing;
+      // INFINITY when the images are identical
+      double psnr;
+      // fraction of pixels with a channel off by more than OUTLIER_ABS
+      double outliers;
+};
+
+// render settings checked against the plain render over a run of frames
+class ConsistencyCase {
+   public:
+      const char* name;
+      // exact settings must reproduce the plain render byte for byte; the others may leave
+      // up to maxOutliers pixels per frame off by more than OUTLIER_ABS
+      bool exact;
+      int maxOutliers;
+      void (*configure)(Scene& scene);
+      // called on both scenes before each frame of the run, k counting from 0; may be NULL
+      void (*edit)(Scene& scene, int k);
+};
+
+const int SIZE = 512;
+// the reference frames are window screenshots; the texture fills the middle half of it
+const int SHOT_WIDTH = 1600;
+const int SHOT_HEIGHT = 1368;
+// single pixels on silhouettes may flip between compilers and CPUs, broad drift may not
+const double MIN_PSNR = 50.0;
+const int OUTLIER_ABS = 16;
+const double MAX_OUTLIERS = 0.001;
+
+// a scene set up like movie1.cpp, movie2.cpp or movie3.cpp; sun must outlive it
+Scene* movieScene(int movie, Sphere& sun);
+// moves the camera, the sun and the light to frame n of the movie
+void moveToFrame(Scene& scene, Sphere& sun, int movie, int n);
+double renderMovieFrame(int movie, int n, unsigned char* image, int reps);
+ImageDiff checkConsistency(ConsistencyCase& c, int movie, int first, int count);
+bool loadReference(const char* path, std::vector<unsigned char>& texels);
+ImageDiff compare(const unsigned char* a, const unsigned char* b, int count);
+
+int main(int argc, char** argv) {
+   bool all = false;
+   int reps = 3;
+   double budgetScale = 1.0;
+   const char* diffDir = NULL;
+   for (int i = 1; i < argc; i++) {
+      if (strcmp(argv[i], "--all") == 0) {
+         all = true;
+      }
+      else if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc) {
+         reps = std::max(1, atoi(argv[++i]));
+      }
+      else if (strcmp(argv[i], "--budget-scale") == 0 && i + 1 < argc) {
+         budgetScale = atof(argv[++i]);
+      }
+      else if (strcmp(argv[i], "--diff") == 0 && i + 1 < argc) {
+         diffDir = argv[++i];
+      }
+      else {
+         fprintf(stderr, "usage: %s [--all] [--reps N] [--budget-scale X] [--diff dir]\n", argv[0]);
+         return 1;
+      }
+   }
+
+   std::vector<RegressionCase> cases;
+   int frameCounts[3] = {120, 120, 301};
+   double budgets[3] = {400.0, 400.0, 600.0};
+   for (int m = 0; m < 3; m++) {
+      int step = all ? 1 : frameCounts[m] / 4;
+      for (int n = 0; n < frameCounts[m]; n += step) {
+         RegressionCase c;
+         c.movie = m + 1;
+         c.frame = n;
+         c.budgetMillis = budgets[m] * budgetScale;
+         cases.push_back(c);
+      }
+   }
+
+   int failures = 0;
+   std::vector<unsigned char> image(SIZE * SIZE * 3), reference;
+   for (int k = 0; k < cases.size(); k++) {
+      RegressionCase& c = cases[k];
+      std::string path = "movie" + std::to_string(c.movie) + "/img" + std::to_string(c.frame) + ".png";
+      if (!loadReference(path.c_str(), reference)) {
+         printf("FAIL %-18s could not load reference\n", path.c_str());
+         failures++;
+         continue;
+      }
+      double millis = renderMovieFrame(c.movie, c.frame, image.data(), reps);
+      ImageDiff d = compare(image.data(), reference.data(), image.size());
+      bool imageOk = d.psnr >= MIN_PSNR && d.outliers <= MAX_OUTLIERS;
+      bool timeOk = millis <= c.budgetMillis;
+      printf("%s %-18s max abs %3d  outliers %.4f%%  psnr %6.2f dB  %8.2f ms (budget %.0f ms)\n",
+         imageOk && timeOk ? "ok  " : "FAIL", path.c_str(), d.maxAbs, 100.0 * d.outliers, d.psnr, millis, c.budgetMillis);
+      if (!imageOk || !timeOk) {
+         failures++;
+      }
+      if (!imageOk && diffDir != NULL) {
+         // side by side: render, reference, amplified difference
+         std::vector<unsigned char> sheet(SIZE * 3 * SIZE * 3);
+         for (int y = 0; y < SIZE; y++) {
+            for (int x = 0; x < SIZE; x++) {
+               for (int ch = 0; ch < 3; ch++) {
+                  int src = (y * SIZE + x) * 3 + ch;
+                  int row = y * SIZE * 3 * 3;
+                  sheet[row + x * 3 + ch] = image[src];
+                  sheet[row + (SIZE + x) * 3 + ch] = reference[src];
+                  sheet[row + (2 * SIZE + x) * 3 + ch] = std::min(255, 8 * abs(image[src] - reference[src]));
+               }
+            }
+         }
+         std::string out = std::string(diffDir) + "/movie" + std::to_string(c.movie) + "_" + std::to_string(c.frame) + ".png";
+         stbi_flip_vertically_on_write(true);
+         stbi_write_png(out.c_str(), SIZE * 3, SIZE, 3, sheet.data(), SIZE * 3 * 3);
+      }
+   }
+   printf("%d of %d frames passed\n", (int) cases.size() - failures, (int) cases.size());
+
+   std::vector<ConsistencyCase> checks;
+   ConsistencyCase hitCache = {"hit cache", true, 0, [](Scene& scene) { scene.cacheHits = true; }, NULL};
+   checks.push_back(hitCache);
+   // the cached hit chains hold material ids, so a surface that changes material halfway
+   // through the run must be traced again
+   ConsistencyCase materialChange = {"hit cache, material change", true, 0, [](Scene& scene) { scene.cacheHits = true; },
+      [](Scene& scene, int k) { scene.surfaces[0]->materialId = k < 3 ? 1 : 2; }};
+   checks.push_back(materialChange);
+   ConsistencyCase shadowMap = {"shadow map", true, 0, [](Scene& scene) { scene.mapShadows = true; }, NULL};
+   checks.push_back(shadowMap);
+   ConsistencyCase shadowCache = {"shadow cache", true, 0, [](Scene& scene) { scene.cacheHits = scene.cacheShadows = true; },
+      NULL};
+   checks.push_back(shadowCache);
+   // reprojection may miss features thinner than a pixel for a frame, nothing more
+   ConsistencyCase reprojection = {"reprojection", false, 1, [](Scene& scene) { scene.reproject = true; }, NULL};
+   checks.push_back(reprojection);
+   // movies 1 and 2 run autotune before their first frame, which must leave reprojection
+   // ready for it
+   ConsistencyCase tunedReprojection = {"reprojection after autotune", false, 1, [](Scene& scene) {
+      scene.reproject = true;
+      std::vector<unsigned char> image(SIZE * SIZE * 3);
+      scene.autotune(image.data(), SIZE, SIZE, 0.0001, 10000.0);
+   }, NULL};
+   checks.push_back(tunedReprojection);
+   int checkFailures = 0;
+   for (int k = 0; k < checks.size(); k++) {
+      for (int m = 0; m < 3; m++) {
+         int first = frameCounts[m] / 2, count = 6;
+         ImageDiff d = checkConsistency(checks[k], m + 1, first, count);
+         int outliers = (int) (d.outliers * SIZE * SIZE + 0.5);
+         bool ok = checks[k].exact ? d.differing == 0 : outliers <= checks[k].maxOutliers;
+         printf("%s %-28s movie%d frames %3d-%3d  differing pixels %5d  outliers %d\n", ok ? "ok  " : "FAIL", checks[k].name,
+            m + 1, first, first + count - 1, d.differing, outliers);
+         checkFailures += !ok;
+      }
+   }
+   printf("%d of %d consistency checks passed\n", (int) checks.size() * 3 - checkFailures, (int) checks.size() * 3);
+   return failures > 0 || checkFailures > 0 ? 1 : 0;
+}
+
+Scene* movieScene(int movie, Sphere& sun) {
+   // same settings as movie1.cpp, movie2.cpp and movie3.cpp
+   DirectionalLight lightSource(1.0, Vector3(2.0, 4.0, 2.0));
+   Vector3 viewDir(0.0, -0.2, -1.0), up(0.0, 1.0, 0.0);
+   Vector3 viewPoint(0.0, 10.0, movie == 1 ? 20.0 : 50.0);
+   float distToCam = movie == 3 ? 10.0 : 40.0;
+   Scene* scene = new Scene(distToCam, viewPoint, up, viewDir, 10.0, -10.0, -10.0, 10.0, SIZE, SIZE, lightSource);
+   scene->setAccelerator(new UniformGrid(true));
+   Color white(255, 255, 255);
+   Material sunMaterial(white, white, white, 1.0, 1.0, 1.0, 1.0);
+   sun.materialId = scene->addMaterial(sunMaterial);
+   if (movie == 3) {
+      sun.castsShadow = false;
+      scene->surfaces.push_back(&sun);
+      scene->cam = &scene->perCam;
+   }
+   return scene;
+}
+
+void moveToFrame(Scene& scene, Sphere& sun, int movie, int n) {
+   float fps = 60.0;
+   float time = n / fps;
+   Vector3 up(0.0, 1.0, 0.0);
+   if (movie == 1) {
+      float period = 12.0;
+      float viewX = cos(time * 2.0 * M_PI / (float) period + M_PI / 3.0) / pow(1.0 + pow(0.2, 2), 0.5f);
+      float viewZ = -sin(time * 2.0 * M_PI / (float) period + M_PI / 3.0) / pow(1.0 + pow(0.2, 2), 0.5f);
+      scene.cam->changeOrientation(Vector3(0.0, 10.0, 20.0), up, Vector3(viewX, -0.2f, viewZ));
+   }
+   else if (movie == 2) {
+      float period = 2.0;
+      Vector3 newViewPoint(50.0 * sin(time * 2.0 * M_PI / (float) period), 10.0, 50.0 * cos(time * 2.0 * M_PI / (float) period));
+      Vector3 focus(0.0, 0.0, 0.0);
+      scene.cam->changeOrientation(newViewPoint, up, (focus - newViewPoint).normalized());
+   }
+   else {
+      int dur = 5;
+      float initialHeight = 2000.0;
+      float deltaHeight = (-sun.radius * 2.0f - initialHeight) / (float) (dur * fps);
+      sun.center = Vector3(750.0, initialHeight + deltaHeight * n, -1500.0);
+      scene.lightSource.dir = sun.center.normalized();
+      scene.lightSource.intensity = 0.3 * (dur * fps - n) / (float) (dur * fps) + 0.7;
+   }
+}
+
+double renderMovieFrame(int movie, int n, unsigned char* image, int reps) {
+   Sphere sun(100.0, Vector3(750.0, 2000.0, -1500.0), 0);
+   Scene* scene = movieScene(movie, sun);
+   moveToFrame(*scene, sun, movie, n);
+   double best = 0.0;
+   for (int r = 0; r < reps; r++) {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      scene->render(image, SIZE, SIZE, 0.0001, 10000.0);
+      double millis = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+      best = r == 0 ? millis : std::min(best, millis);
+   }
+   delete scene;
+   return best;
+}
+
+ImageDiff checkConsistency(ConsistencyCase& c, int movie, int first, int count) {
+   // one scene keeps its caches across the run; every frame is compared with a fresh scene
+   // that has none, and the frame with the most outliers (then differing pixels) is reported
+   Sphere sun(100.0, Vector3(750.0, 2000.0, -1500.0), 0), plainSun = sun;
+   Scene* scene = movieScene(movie, sun);
+   c.configure(*scene);
+   std::vector<unsigned char> image(SIZE * SIZE * 3), plain(SIZE * SIZE * 3);
+   ImageDiff worst;
+   worst.differing = -1;
+   worst.outliers = -1.0;
+   for (int k = 0; k < count; k++) {
+      moveToFrame(*scene, sun, movie, first + k);
+      if (c.edit != NULL) {
+         c.edit(*scene, k);
+      }
+      scene->render(image.data(), SIZE, SIZE, 0.0001, 10000.0);
+      Scene* reference = movieScene(movie, plainSun);
+      moveToFrame(*reference, plainSun, movie, first + k);
+      if (c.edit != NULL) {
+         c.edit(*reference, k);
+      }
+      reference->render(plain.data(), SIZE, SIZE, 0.0001, 10000.0);
+      delete reference;
+      ImageDiff d = compare(image.data(), plain.data(), image.size());
+      if (d.outliers > worst.outliers || (d.outliers == worst.outliers && d.differing > worst.differing)) {
+         worst = d;
+      }
+   }
+   delete scene;
+   return worst;
+}
+
+bool loadReference(const char* path, std::vector<unsigned char>& texels) {
+   int w, h, channels;
+   unsigned char* shot = stbi_load(path, &w, &h, &channels, 3);
+   if (shot == NULL || w != SHOT_WIDTH || h != SHOT_HEIGHT) {
+      stbi_image_free(shot);
+      return false;
+   }
+   // the texture was drawn with nearest filtering onto the quad spanning the middle half of
+   // the window, so the screenshot pixel under each texel centre holds that texel; the file
+   // is stored top row first while texture row 0 is at the bottom
+   texels.resize(SIZE * SIZE * 3);
+   for (int ty = 0; ty < SIZE; ty++) {
+      int glY = SHOT_HEIGHT / 4 + (int) ((ty + 0.5) * (SHOT_HEIGHT / 2) / SIZE);
+      int row = SHOT_HEIGHT - 1 - glY;
+      for (int tx = 0; tx < SIZE; tx++) {
+         int col = SHOT_WIDTH / 4 + (int) ((tx + 0.5) * (SHOT_WIDTH / 2) / SIZE);
+         for (int ch = 0; ch < 3; ch++) {
+            texels[(ty * SIZE + tx) * 3 + ch] = shot[(row * SHOT_WIDTH + col) * 3 + ch];
+         }
+      }
+   }
+   stbi_image_free(shot);
+   return true;
+}
+
+ImageDiff compare(const unsigned char* a, const unsigned char* b, int count) {
+   ImageDiff d;
+   d.maxAbs = 0;
+   double squared = 0.0;
+   int outliers = 0;
+   d.differing = 0;
+   for (int k = 0; k < count; k += 3) {
+      int pixelMax = 0;
+      for (int ch = 0; ch < 3; ch++) {
+         int diff = abs(a[k + ch] - b[k + ch]);
+         pixelMax = std::max(pixelMax, diff);
+         squared += diff * diff;
+      }
+      d.maxAbs = std::max(d.maxAbs, pixelMax);
+      outliers += pixelMax > OUTLIER_ABS;
+      d.differing += pixelMax > 0;
+   }
+   d.outliers = outliers / (count / 3.0);
+   double mse = squared / count;
+   d.psnr = mse > 0.0 ? 10.0 * log10(255.0 * 255.0 / mse) : INFINITY;
+   return d;
+}
@@ -10,12 +10,14 @@
 #include "stb_image/stb_image_write.h"
 
 #include "RayTracer.h"
+#include "Acceleration.h"
 #include <math.h>
 #include <array>
 #include <vector>
 #include <algorithm>
 #include <iostream>
 #include <string>
+#include <cstring>
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void processInput(GLFWwindow *window);
@@ -50,7 +52,56 @@ const char *fragmentShaderSource = "#version 330 core\n"
     "}\n\0";
     
 
-int main() {
+int main(int argc, char** argv) {
+    // --heatmap cycles|tests also writes a false-colored per-pixel cost image,
+    // --probe x y prints how pixel (x, y) was traced, --autotune times a sweep of render
+    // settings first and stores the fastest in cache/ for later runs, --shadow-map answers
+    // shadow queries from a light-space depth map where it can, --lights n adds n point and
+    // spot lights scattered above the floor, --path n path traces n samples per pixel,
+    // --sampler random|sobol|pmj picks where the random numbers come from, --adaptive makes
+    // the --path samples an average spent where pixels are noisiest, --antialias
+    // supersamples the pixels on edges
+    HeatmapMode heatmapMode = HEATMAP_OFF;
+    bool autotune = false;
+    bool mapShadows = false;
+    int lightCount = 0;
+    int pathSamples = 0;
+    bool adaptive = false;
+    bool antialias = false;
+    SamplerKind samplerKind = SAMPLER_SOBOL;
+    int probeX = -1, probeY = -1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--heatmap") == 0 && i + 1 < argc) {
+            heatmapMode = strcmp(argv[i + 1], "tests") == 0 ? HEATMAP_TESTS : HEATMAP_CYCLES;
+        }
+        else if (strcmp(argv[i], "--probe") == 0 && i + 2 < argc) {
+            probeX = atoi(argv[i + 1]);
+            probeY = atoi(argv[i + 2]);
+        }
+        else if (strcmp(argv[i], "--autotune") == 0) {
+            autotune = true;
+        }
+        else if (strcmp(argv[i], "--shadow-map") == 0) {
+            mapShadows = true;
+        }
+        else if (strcmp(argv[i], "--lights") == 0 && i + 1 < argc) {
+            lightCount = atoi(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "--path") == 0 && i + 1 < argc) {
+            pathSamples = atoi(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "--adaptive") == 0) {
+            adaptive = true;
+        }
+        else if (strcmp(argv[i], "--antialias") == 0) {
+            antialias = true;
+        }
+        else if (strcmp(argv[i], "--sampler") == 0 && i + 1 < argc) {
+            samplerKind = strcmp(argv[i + 1], "random") == 0 ? SAMPLER_RANDOM :
+                strcmp(argv[i + 1], "pmj") == 0 ? SAMPLER_PMJ : SAMPLER_SOBOL;
+        }
+    }
+
     // glfw: initialize and configure
     // ------------------------------
     glfwInit();
@@ -168,6 +219,7 @@ int main() {
     int width, height;
     width = 512; height = 512; // keep it in powers of 2!
     unsigned char image[width*height*3];
+    unsigned char heatmap[width*height*3];
 
     // create light source
     float intensity = 1.0;
@@ -183,7 +235,54 @@ int main() {
 
     // create and render scene
     Scene scene(distToCam, viewPoint, up, viewDir, t, b, l, r, width, height, lightSource);
+    scene.setHeatmap(heatmap, heatmapMode);
+    scene.tuningDir = "cache";
+    scene.mapShadows = mapShadows;
+    scene.sampler = Sampler(samplerKind);
+    scene.antialias = antialias;
+    if (pathSamples > 0) {
+        scene.integrator = INTEGRATOR_PATH;
+        scene.samplesPerPixel = pathSamples;
+        scene.adaptiveSampling = adaptive;
+    }
+    // the same total light whatever the count, every third one a spot light pointing down
+    srand(1);
+    for (int k = 0; k < lightCount; k++) {
+        Vector3 pos(rand() / (float) RAND_MAX * 24.0f - 12.0f, rand() / (float) RAND_MAX * 8.0f + 0.5f,
+            rand() / (float) RAND_MAX * 24.0f - 12.0f);
+        float lightIntensity = 32.0f / std::max(16, lightCount);
+        if (k % 3 == 2) {
+            scene.lights.push_back(new SpotLight(3.0f * lightIntensity, pos, 6.0, Vector3(0.0, -1.0, 0.0), 0.3, 0.6));
+        }
+        else {
+            scene.lights.push_back(new PointLight(lightIntensity, pos, 4.0));
+        }
+    }
+    UniformGrid* grid = new UniformGrid(true);
+    grid->cacheDir = "cache";
+    scene.setAccelerator(grid);
+    if (autotune) {
+        scene.autotune(image, width, height, tmin, tmax);
+    }
     scene.render(image, width, height, tmin, tmax);
+    if (pathSamples > 0) {
+        std::cout << "Path tracing: " << scene.samplesPerSec / 1e6 << " million samples/s" << std::endl;
+        if (adaptive) {
+            std::cout << "Converged pixels: " << 100.0 * scene.convergedFraction << "%" << std::endl;
+        }
+    }
+    std::cout << "Time to first ray: " << scene.startupMillis << " ms (acceleration structure "
+        << (grid->loadedFromCache ? "loaded from cache" : "built") << " in " << grid->buildMillis << " ms)" << std::endl;
+
+    if (heatmapMode != HEATMAP_OFF) {
+        stbi_flip_vertically_on_write(true);
+        stbi_write_png("heatmap.png", width, height, 3, heatmap, width * 3);
+    }
+    if (probeX >= 0 && probeY >= 0) {
+        PixelProbe probe;
+        scene.probePixel(probeX, probeY, tmin, tmax, probe);
+        probe.print(std::cout);
+    }
 
     unsigned char *data = &image[0];
     if (data) {
@@ -246,6 +345,8 @@ int main() {
     glDeleteBuffers(1, &VBO);
     glDeleteBuffers(1, &EBO);
 
+    scene.memoryReport().print(stdout);
+
     // glfw: terminate, clearing all previously allocated GLFW resources.
     // ------------------------------------------------------------------
     glfwTerminate();